@@ -0,0 +1,163 @@
+#include "batch.h"
+#include "opencl.h"
+
+#include <algorithm>
+
+namespace pv {
+
+namespace {
+
+cv::Mat to_bgr(const cv::Mat& image) {
+  if (image.channels() == 3) {
+    return image;
+  }
+  cv::Mat bgr;
+  cv::cvtColor(image, bgr, CV_GRAY2BGR);
+  return bgr;
+}
+
+int round_up(int value, int multiple) {
+  return (value + multiple - 1) / multiple * multiple;
+}
+
+}
+
+BatchPaste::BatchPaste() :
+    solver_(),
+    context_(),
+    queue_(),
+    jobs_(),
+    solution_(),
+    solution_x_(),
+    solution_y_() {
+}
+
+void BatchPaste::init(cl::Context context, cl::CommandQueue queue) {
+  context_ = context;
+  queue_ = queue;
+  solver_.init(context, queue);
+}
+
+size_t BatchPaste::add_job(cv::Mat source, cv::Mat mask, cv::Mat target,
+                           int x, int y) {
+  Job job;
+  job.source = to_bgr(source);
+  job.mask = mask.empty() ?
+             cv::Mat(cv::Mat::ones(source.size(), CV_8U) * 255) : mask;
+  job.target = target;
+  job.x = x;
+  job.y = y;
+  jobs_.push_back(job);
+  return jobs_.size() - 1;
+}
+
+void BatchPaste::clear() {
+  jobs_.clear();
+}
+
+// Shelf packing in the order of the jobs. Every job gets a cell of multiples
+// of GUARD with its source GUARD / 2 pixels from the top left corner.
+void BatchPaste::pack(cv::Size& atlas_size) {
+  int width = ATLAS_WIDTH;
+  for (size_t i = 0; i < jobs_.size(); ++i) {
+    width = std::max(width, round_up(jobs_[i].source.cols + GUARD, GUARD));
+  }
+  int x = 0;
+  int y = 0;
+  int shelf_height = 0;
+  for (size_t i = 0; i < jobs_.size(); ++i) {
+    int cell_width = round_up(jobs_[i].source.cols + GUARD, GUARD);
+    int cell_height = round_up(jobs_[i].source.rows + GUARD, GUARD);
+    if (x + cell_width > width) {
+      x = 0;
+      y += shelf_height;
+      shelf_height = 0;
+    }
+    jobs_[i].atlas_x = x + GUARD / 2;
+    jobs_[i].atlas_y = y + GUARD / 2;
+    x += cell_width;
+    shelf_height = std::max(shelf_height, cell_height);
+  }
+  atlas_size = cv::Size(width, y + shelf_height);
+}
+
+int BatchPaste::solve(float tolerance, int max_cycles) {
+  if (jobs_.empty()) {
+    return 0;
+  }
+  cv::Size atlas_size;
+  pack(atlas_size);
+
+  // The target atlas holds the target around each job where the source atlas
+  // holds the job, so all jobs are solved with offset 0. Like the sampler of
+  // setup_system, pixels beyond the target border repeat the border.
+  cv::Mat source(atlas_size, CV_8UC3, cv::Scalar::all(0));
+  cv::Mat mask(atlas_size, CV_8U, cv::Scalar::all(0));
+  cv::Mat target(atlas_size, CV_8UC3, cv::Scalar::all(0));
+  for (size_t i = 0; i < jobs_.size(); ++i) {
+    const Job& job = jobs_[i];
+    cv::Rect rect(job.atlas_x, job.atlas_y, job.source.cols, job.source.rows);
+    job.source.copyTo(source(rect));
+    job.mask.copyTo(mask(rect));
+
+    cv::Mat job_target = to_bgr(job.target);
+    for (int y = -GUARD / 2; y < job.source.rows + GUARD / 2; ++y) {
+      int target_y = std::min(std::max(job.y + y, 0), job_target.rows - 1);
+      cv::Vec3b* row = target.ptr<cv::Vec3b>(job.atlas_y + y);
+      for (int x = -GUARD / 2; x < job.source.cols + GUARD / 2; ++x) {
+        int target_x = std::min(std::max(job.x + x, 0), job_target.cols - 1);
+        row[job.atlas_x + x] = job_target.at<cv::Vec3b>(target_y, target_x);
+      }
+    }
+  }
+  solver_.set_source(source, mask);
+  solver_.set_target(target);
+  int cycles = solver_.solve_until(tolerance, max_cycles);
+
+  // The grids may hold half floats, see SimpleVCycle::set_precision
+  int x, y, width, height;
+  solver_.get_domain(x, y, width, height);
+  cl::Image2D solution_image(context_, CL_MEM_READ_WRITE,
+                             cl::ImageFormat(CL_RGBA, CL_FLOAT),
+                             size_t(width), size_t(height));
+  solver_.copy_solution(solution_image);
+  cv::Mat solution = read_cl_image(queue_, solution_image);
+  // The solver works on the vertically flipped atlas
+  cv::flip(solution, solution_, 0);
+  solution_x_ = x;
+  solution_y_ = atlas_size.height - y - height;
+  return cycles;
+}
+
+void BatchPaste::paste(size_t job_index) {
+  const Job& job = jobs_[job_index];
+  cv::Mat target = job.target;
+  for (int y = 0; y < job.source.rows; ++y) {
+    int target_y = job.y + y;
+    if (target_y < 0 || target_y >= target.rows) {
+      continue;
+    }
+    const float* solution = solution_.ptr<float>(job.atlas_y + y -
+                                                 solution_y_);
+    for (int x = 0; x < job.source.cols; ++x) {
+      int target_x = job.x + x;
+      if (!job.mask.at<uchar>(y, x) ||
+          target_x < 0 || target_x >= target.cols) {
+        continue;
+      }
+      // RGBA in the solution, BGR or grayscale in the target
+      const float* rgba = solution + 4 * (job.atlas_x + x - solution_x_);
+      if (target.channels() == 3) {
+        cv::Vec3b& pixel = target.at<cv::Vec3b>(target_y, target_x);
+        for (int c = 0; c < 3; ++c) {
+          pixel[c] = cv::saturate_cast<uchar>(rgba[2 - c]);
+        }
+      } else {
+        target.at<uchar>(target_y, target_x) =
+            cv::saturate_cast<uchar>(rgba[0]);
+      }
+    }
+  }
+}
+
+}
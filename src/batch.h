@@ -0,0 +1,67 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <vector>
+
+#include "context.h"
+
+namespace pv {
+
+// Solves many small pastes as one system. The sources of the jobs are packed
+// side by side into an atlas with guard bands between them, together with
+// the part of their target they are pasted on, so that a single SimpleVCycle
+// serves the whole batch with one launch per kernel and level.
+class BatchPaste {
+ public:
+  BatchPaste();
+
+  void init(cl::Context context, cl::CommandQueue queue);
+
+  // Pastes the pixels of source under mask (8 bit BGR or grayscale) into
+  // target with the top left corner of source at (x, y) of target. Returns
+  // the index of the job for paste().
+  size_t add_job(cv::Mat source, cv::Mat mask, cv::Mat target, int x, int y);
+  void clear();
+
+  // Solves all jobs added since the last clear(), returns the number of
+  // cycles run. See Solver::solve_until.
+  int solve(float tolerance, int max_cycles);
+  // Writes the solution of job into its target
+  void paste(size_t job);
+
+  SimpleVCycle& solver() { return solver_; }
+
+ private:
+  struct Job {
+    Job() : source(), mask(), target(), x(), y(), atlas_x(), atlas_y() {}
+    cv::Mat source;
+    cv::Mat mask;
+    cv::Mat target;
+    int x;
+    int y;
+    // Position of source in the atlas
+    int atlas_x;
+    int atlas_y;
+  };
+
+  // Least gap between the sources of two jobs. Cells are multiples of it,
+  // which keeps the jobs apart on the first coarse grids as well.
+  static const int GUARD = 16;
+  static const int ATLAS_WIDTH = 2048;
+
+  void pack(cv::Size& atlas_size);
+
+  SimpleVCycle solver_;
+  cl::Context context_;
+  cl::CommandQueue queue_;
+  std::vector<Job> jobs_;
+
+  // Solution of the atlas, unflipped, and its position in the atlas
+  cv::Mat solution_;
+  int solution_x_;
+  int solution_y_;
+};
+
+}
+
+#endif  // BATCH_H_
@@ -0,0 +1,85 @@
+#include "paste.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <highgui.h>
+
+namespace pv {
+
+Paste::Paste() :
+    tolerance(0.01f),
+    max_cycles(100),
+    source(),
+    mask(),
+    target(),
+    x(),
+    y(),
+    output() {
+}
+
+bool Paste::parse(int argc, char* argv[], std::vector<std::string>& flags) {
+  std::vector<std::string> arguments;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+      tolerance = float(atof(argv[++i]));
+    } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+      max_cycles = atoi(argv[++i]);
+    } else if (!strncmp(argv[i], "--", 2)) {
+      flags.push_back(argv[i]);
+    } else {
+      arguments.push_back(argv[i]);
+    }
+  }
+  if (arguments.size() != 6) {
+    return false;
+  }
+
+  source = cv::imread(arguments[0]);
+  mask = cv::imread(arguments[1], 0);
+  target = cv::imread(arguments[2]);
+  if (source.empty() || mask.empty() || target.empty()) {
+    std::cerr << "ERROR: cannot read the input images" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  x = atoi(arguments[3].c_str());
+  y = atoi(arguments[4].c_str());
+  output = arguments[5];
+  return true;
+}
+
+int Paste::off_x() const {
+  return x;
+}
+
+int Paste::off_y() const {
+  return target.rows - source.rows - y;
+}
+
+void Paste::write(cv::Mat solution, int domain_x, int domain_y) {
+  // Pixels inside the mask have a nonzero w, the colours are RGB
+  for (int j = 0; j < solution.rows; ++j) {
+    const cv::Vec4f* row = solution.ptr<cv::Vec4f>(j);
+    int target_y = source.rows - 1 - (domain_y + j) + y;
+    if (target_y < 0 || target_y >= target.rows) {
+      continue;
+    }
+    for (int i = 0; i < solution.cols; ++i) {
+      int target_x = domain_x + i + x;
+      if (row[i][3] == 0.0f || target_x < 0 || target_x >= target.cols) {
+        continue;
+      }
+      cv::Vec3b& pixel = target.at<cv::Vec3b>(target_y, target_x);
+      for (int c = 0; c < 3; ++c) {
+        pixel[c] = cv::saturate_cast<uchar>(row[i][2 - c]);
+      }
+    }
+  }
+  if (!cv::imwrite(output, target)) {
+    std::cerr << "ERROR: cannot write " << output << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+}
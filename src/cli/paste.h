@@ -0,0 +1,53 @@
+#ifndef PASTE_H_
+#define PASTE_H_
+
+#include <cv.h>
+
+#include <string>
+#include <vector>
+
+namespace pv {
+
+// A paste as given on the command line of pv-paste and pv-paste-native:
+//
+//   [-t tolerance] [-c max_cycles] [flags] source mask target x y output
+//
+// The pixels of source where mask is nonzero are blended into target with
+// the top left corner of source at (x, y) of target.
+struct Paste {
+  Paste();
+
+  // Reads the images, returns false on a malformed command line. Arguments
+  // starting with -- go to flags for the command to check.
+  bool parse(int argc, char* argv[], std::vector<std::string>& flags);
+  // Offset to pass to set_offset, the solvers place the flipped source in
+  // the flipped target
+  int off_x() const;
+  int off_y() const;
+  // Copies the pixels inside the mask of solution, a CV_32FC4 image of the
+  // domain at (domain_x, domain_y), into target and writes it to output
+  void write(cv::Mat solution, int domain_x, int domain_y);
+
+  float tolerance;
+  int max_cycles;
+  cv::Mat source;
+  cv::Mat mask;
+  cv::Mat target;
+  int x;
+  int y;
+  std::string output;
+};
+
+// Sets up paste on a pv::Solver or pv::NativeVCycle and solves it, returns
+// the number of cycles
+template <class S>
+int solve(S& solver, const Paste& paste) {
+  solver.set_source(paste.source, paste.mask);
+  solver.set_target(paste.target);
+  solver.set_offset(paste.off_x(), paste.off_y());
+  return solver.solve_until(paste.tolerance, paste.max_cycles);
+}
+
+}
+
+#endif  // PASTE_H_
@@ -0,0 +1,91 @@
+// Pastes an image into another one without any display:
+//
+//   pv-paste [-t tolerance] [-c max_cycles] [--devices]
+//            source mask target x y output
+//
+// The pixels of source where mask is nonzero are blended into target with
+// the top left corner of source at (x, y) of target, and the result is
+// written to output. Solves with OpenCL (the planar solver on CPU devices)
+// or, with --devices, split across all devices by MultiDeviceVCycle.
+// pv-paste-native solves without OpenCL.
+
+#include "opencl.h"
+#include "context.h"
+#include "multi_device.h"
+#include "paste.h"
+#include "planar.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+
+namespace {
+
+void usage() {
+  std::cerr << "usage: pv-paste [-t tolerance] [-c max_cycles] [--devices]"
+            << " source mask target x y output" << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+// Solution of the domain as CV_32FC4, vertically flipped like all solver
+// images
+cv::Mat read_solution(cl::CommandQueue& queue, pv::Solver& solver) {
+  int x, y, width, height;
+  solver.get_domain(x, y, width, height);
+  cv::Mat solution(height, width, CV_32FC4);
+  cl::size_t<3> origin;
+  origin.push_back(0);
+  origin.push_back(0);
+  origin.push_back(0);
+  cl::size_t<3> region;
+  region.push_back(size_t(width));
+  region.push_back(size_t(height));
+  region.push_back(1);
+  queue.enqueueReadImage(solver.current_solution(), CL_TRUE,
+                         origin, region, 0, 0, solution.data);
+  return solution;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  pv::Paste paste;
+  std::vector<std::string> flags;
+  if (!paste.parse(argc, argv, flags)) {
+    usage();
+  }
+  bool devices = false;
+  for (size_t i = 0; i < flags.size(); ++i) {
+    if (flags[i] == "--devices") {
+      devices = true;
+    } else {
+      usage();
+    }
+  }
+
+  cl::Context context;
+  cl::CommandQueue queue;
+  std::shared_ptr<pv::Solver> solver;
+  if (devices) {
+    std::vector<cl::CommandQueue> queues;
+    pv::init_cl_devices(context, queues);
+    std::shared_ptr<pv::MultiDeviceVCycle> multi(new pv::MultiDeviceVCycle);
+    multi->init(context, queues);
+    solver = multi;
+    queue = queues[0];
+  } else {
+    if (pv::init_cl(context, queue) == CL_DEVICE_TYPE_CPU) {
+      solver.reset(new pv::PlanarVCycle);
+    } else {
+      solver.reset(new pv::SimpleVCycle);
+    }
+    solver->init(context, queue);
+  }
+  int cycles = pv::solve(*solver, paste);
+  std::cerr << "Solved in " << cycles << " cycles" << std::endl;
+
+  int domain_x, domain_y, width, height;
+  solver->get_domain(domain_x, domain_y, width, height);
+  paste.write(read_solution(queue, *solver), domain_x, domain_y);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,32 @@
+// Pastes an image into another one with NativeVCycle, without OpenCL:
+//
+//   pv-paste-native [-t tolerance] [-c max_cycles]
+//                   source mask target x y output
+//
+// See pv_paste.cpp. Links neither pv_core nor the OpenCL library, so it
+// runs on hosts without an OpenCL runtime.
+
+#include "native.h"
+#include "paste.h"
+
+#include <cstdlib>
+#include <iostream>
+
+int main(int argc, char* argv[]) {
+  pv::Paste paste;
+  std::vector<std::string> flags;
+  if (!paste.parse(argc, argv, flags) || !flags.empty()) {
+    std::cerr << "usage: pv-paste-native [-t tolerance] [-c max_cycles]"
+              << " source mask target x y output" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  pv::NativeVCycle solver;
+  int cycles = pv::solve(solver, paste);
+  std::cerr << "Solved in " << cycles << " cycles" << std::endl;
+
+  int domain_x, domain_y, width, height;
+  solver.get_domain(domain_x, domain_y, width, height);
+  paste.write(solver.current_solution(), domain_x, domain_y);
+  return EXIT_SUCCESS;
+}
@@ -1,72 +1,207 @@
 #include "opencl.h"
 #include "context.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
 #include <iostream>
-#include <numeric>
+#include <sstream>
+#include <stdexcept>
 
 namespace pv {
 
-SimpleVCycle::SimpleVCycle() :
+namespace {
+
+// Whether the device of queue can read and write one image in a kernel,
+// which needs OpenCL C 2.0 and the float format of order (and the half
+// float one if half is set) to support it.
+bool read_write_images(const cl::Context& context,
+                       const cl::CommandQueue& queue,
+                       cl_channel_order order, bool half) {
+#ifdef CL_MEM_KERNEL_READ_AND_WRITE
+  // "OpenCL C <major>.<minor> <vendor-specific information>"
+  std::string version = queue.getInfo<CL_QUEUE_DEVICE>()
+                             .getInfo<CL_DEVICE_OPENCL_C_VERSION>();
+  if (version.compare(0, 9, "OpenCL C ") != 0 ||
+      std::atoi(version.c_str() + 9) < 2) {
+    return false;
+  }
+  std::vector<cl::ImageFormat> formats;
+  context.getSupportedImageFormats(
+      CL_MEM_READ_WRITE | CL_MEM_KERNEL_READ_AND_WRITE,
+      CL_MEM_OBJECT_IMAGE2D, &formats);
+  bool float_found = false;
+  bool half_found = false;
+  for (size_t i = 0; i < formats.size(); ++i) {
+    if (formats[i].image_channel_order == order) {
+      float_found |= formats[i].image_channel_data_type == CL_FLOAT;
+      half_found |= formats[i].image_channel_data_type == CL_HALF_FLOAT;
+    }
+  }
+  return float_found && (half_found || !half);
+#else
+  (void) context;
+  (void) queue;
+  (void) order;
+  (void) half;
+  return false;
+#endif
+}
+
+}
+
+template <int Channels>
+BasicVCycle<Channels>::BasicVCycle() :
     program_(),
     jacobi(),
+    gauss_seidel(),
+    gauss_seidel_residual(),
     calculate_residual(),
-    setup_system(),
+    setup_guidance(),
+    update_boundary(),
     reset_image(),
-    reduce(),
+    reduce_norms(),
+    reduce_products(),
+    reduce_norms_partial(),
     copy_xyz(),
-    add_images(),
-    bilinear_interp(),
+    interp_add(),
     bilinear_restrict(),
+    collect_active_tiles(),
+    copy_image(),
+    add_plane(),
+    rim_pixels_(),
+    rhs_replaced_(false),
     b_stack(),
     x1_stack(),
     x2_stack(),
     residual_stack(),
-    current_grid_() {
+    tile_stack(),
+    tile_count_stack(),
+    current_grid_(),
+    full_multigrid_(false),
+    fmg_pending_(false),
+    cycle_type_(V_CYCLE),
+    pre_smoothing_(1, 1),
+    post_smoothing_(1, 1),
+    smoother_(GAUSS_SEIDEL),
+    residual_monitoring_(true),
+    tile_size_(16),
+    jacobi_sweeps_(10),
+    precision_(FULL_PRECISION),
+    channel_order_(CHANNEL_ORDER),
+    half_supported_(false),
+    in_place_(false),
+    max_work_group_size_(),
+    local_mem_size_(),
+    residual_partials_(),
+    residual_partials_capacity_(),
+    residual_results_(),
+    pending_query_(),
+    residual_query_pending_(false),
+    last_residual_average_() {
 }
 
-void SimpleVCycle::set_source(cv::Mat source, cv::Mat mask) {
+template <int Channels>
+void BasicVCycle<Channels>::set_source(cv::Mat source, cv::Mat mask) {
   Solver::set_source(source, mask);
 
-  b_stack.push_back(cl::Image2D(context_, CL_MEM_READ_WRITE,
-                     cl::ImageFormat(CL_RGBA, CL_FLOAT),
+  // A new source starts over with new grids, build_multigrid() would keep
+  // the finest ones of the last source
+  b_stack.clear();
+  x1_stack.clear();
+  x2_stack.clear();
+  residual_stack.clear();
+  tile_stack.clear();
+  tile_count_stack.clear();
+
+  b_stack.push_back(cl::Image2D(context_, CL_MEM_READ_WRITE, level_format(0),
+                    size_t(source_.cols), size_t(source_.rows)));
+  x1_stack.push_back(cl::Image2D(context_, CL_MEM_READ_WRITE, level_format(0),
                      size_t(source_.cols), size_t(source_.rows)));
-  x1_stack.push_back(cl::Image2D(context_, CL_MEM_READ_WRITE,
-                   cl::ImageFormat(CL_RGBA, X_CL_TYPE),
-                   size_t(source_.cols), size_t(source_.rows)));
-  x2_stack.push_back(cl::Image2D(context_, CL_MEM_READ_WRITE,
-                   cl::ImageFormat(CL_RGBA, X_CL_TYPE),
-                   size_t(source_.cols), size_t(source_.rows)));
+  if (ping_pong()) {
+    x2_stack.push_back(cl::Image2D(context_, CL_MEM_READ_WRITE,
+                       level_format(0),
+                       size_t(source_.cols), size_t(source_.rows)));
+  }
   residual_stack.push_back(cl::Image2D(context_, CL_MEM_READ_WRITE,
-                     cl::ImageFormat(CL_RGBA, X_CL_TYPE),
-                     size_t(source_.cols), size_t(source_.rows)));
+                           level_format(0),
+                           size_t(source_.cols), size_t(source_.rows)));
 
   launch_reset_image(false, residual_stack[0]);
   launch_reset_image(false, x1_stack[0]);
-  launch_reset_image(false, x2_stack[0]);
+  if (!x2_stack.empty()) {
+    launch_reset_image(false, x2_stack[0]);
+  }
   launch_reset_image(false, b_stack[0]);
+
+  rim_pixels_ = create_rim_buffer();
 }
 
-void SimpleVCycle::set_target(cv::Mat target) {
+template <int Channels>
+void BasicVCycle<Channels>::set_target(cv::Mat target) {
   Solver::set_target(target);
 
   setup_new_system(true);
-  build_multigrid(true);
+  build_multigrid();
 }
 
-void SimpleVCycle::init(cl::Context context,
+template <int Channels>
+void BasicVCycle<Channels>::init(cl::Context context,
                         cl::CommandQueue queue) {
   Solver::init(context, queue);
 
-  program_ = pv::load_program(context_, "hellocl_kernels");
+  std::vector<cl::ImageFormat> formats;
+  context_.getSupportedImageFormats(CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D,
+                                    &formats);
+  // CL_RGBA with CL_FLOAT is the only format of the two that every device
+  // supports
+  channel_order_ = CL_RGBA;
+  for (size_t i = 0; i < formats.size(); ++i) {
+    if (formats[i].image_channel_order == CHANNEL_ORDER &&
+        formats[i].image_channel_data_type == CL_FLOAT) {
+      channel_order_ = CHANNEL_ORDER;
+    }
+  }
+  half_supported_ = false;
+  for (size_t i = 0; i < formats.size(); ++i) {
+    if (formats[i].image_channel_order == channel_order_ &&
+        formats[i].image_channel_data_type == CL_HALF_FLOAT) {
+      half_supported_ = true;
+    }
+  }
+  // set_precision() may ask for half float grids after init(), so both
+  // formats have to allow in-place updates
+  in_place_ = read_write_images(context_, queue_, channel_order_,
+                                half_supported_);
+
+  cl::Device device = queue_.getInfo<CL_QUEUE_DEVICE>();
+  max_work_group_size_ = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+  local_mem_size_ = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+  check_blocking(tile_size_, jacobi_sweeps_, smoother_);
+
+  std::ostringstream defines;
+  defines << "-D PIXEL_CHANNELS=" << Channels;
+  if (in_place_) {
+    defines << " -cl-std=CL2.0 -D READ_WRITE_IMAGES";
+  }
+  program_ = pv::load_program(context_, "hellocl_kernels", defines.str());
   try {
-    setup_system = cl::Kernel(program_, "setup_system", NULL);
+    setup_guidance = cl::Kernel(program_, "setup_guidance", NULL);
+    update_boundary = cl::Kernel(program_, "update_boundary", NULL);
     jacobi = cl::Kernel(program_, "jacobi", NULL);
+    gauss_seidel = cl::Kernel(program_, "gauss_seidel", NULL);
+    gauss_seidel_residual = cl::Kernel(program_, "gauss_seidel_residual",
+                                       NULL);
     calculate_residual = cl::Kernel(program_, "calculate_residual", NULL);
     reset_image = cl::Kernel(program_, "reset_image", NULL);
-    reduce = cl::Kernel(program_, "reduce", NULL);
-    add_images = cl::Kernel(program_, "add_images", NULL);
-    bilinear_interp = cl::Kernel(program_, "bilinear_interp", NULL);
+    reduce_norms = cl::Kernel(program_, "reduce_norms", NULL);
+    reduce_products = cl::Kernel(program_, "reduce_products", NULL);
+    reduce_norms_partial = cl::Kernel(program_, "reduce_norms_partial", NULL);
+    interp_add = cl::Kernel(program_, "interp_add", NULL);
     bilinear_restrict = cl::Kernel(program_, "bilinear_restrict", NULL);
+    collect_active_tiles = cl::Kernel(program_, "collect_active_tiles", NULL);
+    copy_image = cl::Kernel(program_, "copy_image", NULL);
+    add_plane = cl::Kernel(program_, "add_plane", NULL);
   } catch (cl::Error error) {
     std::cerr << "ERROR: "
               << error.what()
@@ -74,209 +209,649 @@ void SimpleVCycle::init(cl::Context context,
               << std::endl;
     exit(EXIT_FAILURE);
   }
+
+  residual_partials_capacity_ = 0;
+  residual_results_.clear();
 }
 
-float SimpleVCycle::get_residual_average() {
-  size_t global_size = 1024;
-  size_t local_size = 16;
-  size_t nr_groups = global_size / local_size;
+template <int Channels>
+cl::ImageFormat BasicVCycle<Channels>::level_format(size_t level) const {
+  bool half = half_supported_ &&
+              (precision_ == HALF_PRECISION ||
+               (precision_ == HALF_COARSE_GRIDS && level > 0));
+  return cl::ImageFormat(channel_order_, half ? CL_HALF_FLOAT : CL_FLOAT);
+}
 
-  size_t nr_pixels = residual_stack[0].getImageInfo<CL_IMAGE_WIDTH>() *
-                     residual_stack[0].getImageInfo<CL_IMAGE_HEIGHT>();
+template <int Channels>
+float BasicVCycle<Channels>::get_residual_average() {
+  ResidualQuery query = enqueue_residual_query();
+  return finish_residual_query(query).average;
+}
 
-  cl::Buffer result(context_, CL_MEM_WRITE_ONLY, nr_groups * sizeof(cl_float));
+template <int Channels>
+VCycleBase::ResidualNorms BasicVCycle<Channels>::get_residual_norms() {
+  ResidualQuery query = enqueue_residual_query();
+  return finish_residual_query(query);
+}
 
-  reduce.setArg<cl::Image2D>(0, residual_stack[0]);
-  reduce.setArg<cl_ulong>(1, nr_pixels);
-  reduce.setArg(2, local_size * sizeof(cl_float), NULL);
-  reduce.setArg<cl::Buffer>(3, result);
+template <int Channels>
+VCycleBase::ResidualNorms BasicVCycle<Channels>::get_norms(
+    const cl::Image2D& image) {
+  ResidualQuery query = enqueue_norms_query(image);
+  return finish_residual_query(query);
+}
 
-  cl::Event ev;
+template <int Channels>
+VCycleBase::ResidualQuery BasicVCycle<Channels>::enqueue_residual_query() {
+  return enqueue_norms_query(residual_stack[0]);
+}
+
+template <int Channels>
+VCycleBase::ResidualQuery BasicVCycle<Channels>::enqueue_norms_query(
+    const cl::Image2D& residual) {
+  size_t width = residual.getImageInfo<CL_IMAGE_WIDTH>();
+  size_t height = residual.getImageInfo<CL_IMAGE_HEIGHT>();
+
+  // Every query in flight needs its own result buffer, as it stays mapped
+  // until the query is finished. Buffers are recycled afterwards.
+  if (residual_results_.empty()) {
+    residual_results_.push_back(cl::Buffer(context_,
+                                CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR,
+                                2 * sizeof(cl_float4)));
+  }
+  ResidualQuery query;
+  query.result = residual_results_.back();
+  query.nr_pixels = width * height;
+  residual_results_.pop_back();
+
+  reduce_norms.setArg<cl::Image2D>(0, residual);
+  enqueue_reduction(reduce_norms, 1, width, height, query.result);
+
+  query.value = static_cast<cl_float4*>(
+      queue_.enqueueMapBuffer(query.result, CL_FALSE, CL_MAP_READ,
+                              0, 2 * sizeof(cl_float4), NULL, &query.ready));
+  queue_.flush();
+  return query;
+}
+
+template <int Channels>
+VCycleBase::ResidualNorms BasicVCycle<Channels>::finish_residual_query(
+    const ResidualQuery& query) {
+  query.ready.wait();
+  ResidualNorms norms;
+  norms.l2 = query.value[0];
+  norms.max = query.value[1];
+  queue_.enqueueUnmapMemObject(query.result, query.value);
+  residual_results_.push_back(query.result);
+
+  norms.average = (norms.l2.s[0] + norms.l2.s[1] + norms.l2.s[2]) /
+                  float(query.nr_pixels);
+  for (int i = 0; i < 4; ++i) {
+    norms.l2.s[i] = std::sqrt(norms.l2.s[i]);
+  }
+  return norms;
+}
+
+template <int Channels>
+void BasicVCycle<Channels>::enqueue_dot_product(const cl::Image2D& lhs,
+                                                const cl::Image2D& rhs,
+                                                const cl::Buffer& result) {
+  reduce_products.setArg<cl::Image2D>(0, lhs);
+  reduce_products.setArg<cl::Image2D>(1, rhs);
+  enqueue_reduction(reduce_products, 2,
+                    lhs.getImageInfo<CL_IMAGE_WIDTH>(),
+                    lhs.getImageInfo<CL_IMAGE_HEIGHT>(), result);
+}
+
+// Runs first_stage, whose local memory and output arguments start at arg,
+// over width x height in tiles of REDUCE_TILE_SIZE^2 and reduces the pairs
+// it leaves per work-group until a single pair is left in result.
+template <int Channels>
+void BasicVCycle<Channels>::enqueue_reduction(cl::Kernel& first_stage,
+                                              cl_uint arg,
+                                              size_t width, size_t height,
+                                              const cl::Buffer& result) {
+  size_t groups_x = (width + REDUCE_TILE_SIZE - 1) / REDUCE_TILE_SIZE;
+  size_t groups_y = (height + REDUCE_TILE_SIZE - 1) / REDUCE_TILE_SIZE;
+  size_t count = groups_x * groups_y;
+  size_t local_size = REDUCE_TILE_SIZE * REDUCE_TILE_SIZE;
+
+  // Each stage leaves one (sum, maximum) pair per work-group, the last stage
+  // writes its single pair straight into the result buffer.
+  if (count > residual_partials_capacity_) {
+    for (int i = 0; i < 2; ++i) {
+      residual_partials_[i] = cl::Buffer(context_, CL_MEM_READ_WRITE,
+                                         2 * count * sizeof(cl_float4));
+    }
+    residual_partials_capacity_ = count;
+  }
+  first_stage.setArg(arg, local_size * sizeof(cl_float4), NULL);
+  first_stage.setArg(arg + 1, local_size * sizeof(cl_float4), NULL);
+  first_stage.setArg<cl::Buffer>(arg + 2, count == 1 ?
+      result : residual_partials_[0]);
   queue_.enqueueNDRangeKernel(
-    reduce,
+    first_stage,
     cl::NullRange,
-    cl::NDRange(global_size),
-    cl::NDRange(local_size),
-    NULL, &ev
+    cl::NDRange(groups_x * REDUCE_TILE_SIZE, groups_y * REDUCE_TILE_SIZE),
+    cl::NDRange(REDUCE_TILE_SIZE, REDUCE_TILE_SIZE)
   );
-  ev.wait();
-  std::vector<cl_float> result_host(nr_groups);
-  queue_.enqueueReadBuffer(result, CL_TRUE, 0,
-                           nr_groups * sizeof(cl_float),
-                           &result_host[0]);
-  return std::accumulate(result_host.begin(), result_host.end(), .0f) /
-         float(nr_pixels);
-  // return result_host[0];
-}
-
-void SimpleVCycle::jacobi_iterations(int iterations) {
-  size_t local_size = 8;
-  size_t glob_width = x1_stack[current_grid_].getImageInfo<CL_IMAGE_WIDTH>();
-  size_t glob_height = x1_stack[current_grid_].getImageInfo<CL_IMAGE_HEIGHT>();
-  glob_width = (glob_width / local_size + bool(glob_width % local_size))
-             * local_size;
-  glob_height = (glob_height / local_size + bool(glob_height % local_size))
-              * local_size;
+  reduce_partial_norms(queue_, reduce_norms_partial, residual_partials_,
+                       count, local_size, result);
+}
+
+template <int Channels>
+float BasicVCycle<Channels>::get_residual_average_async() {
+  if (residual_query_pending_) {
+    if (pending_query_.ready.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() !=
+        CL_COMPLETE) {
+      return last_residual_average_;
+    }
+    last_residual_average_ = finish_residual_query(pending_query_).average;
+  }
+  pending_query_ = enqueue_residual_query();
+  residual_query_pending_ = true;
+  return last_residual_average_;
+}
+
+template <int Channels>
+int BasicVCycle<Channels>::solve_until(float tolerance, int max_cycles) {
+  int cycles = 0;
+  bool pending = false;
+  ResidualQuery previous;
+  while (cycles < max_cycles) {
+    int batch = max_cycles - cycles;
+    if (batch > RESIDUAL_CHECK_INTERVAL) {
+      batch = RESIDUAL_CHECK_INTERVAL;
+    }
+    start_calculation_async(batch);
+    cycles += batch;
+    ResidualQuery current = enqueue_residual_query();
+    // The residual of the previous batch is read back while the device works
+    // on the batch that was just queued, so the host only waits here if the
+    // device is more than one batch behind.
+    if (pending && finish_residual_query(previous).average <= tolerance) {
+      finish_residual_query(current);
+      return cycles;
+    }
+    previous = current;
+    pending = true;
+  }
+  if (pending) {
+    finish_residual_query(previous);
+  }
+  return cycles;
+}
+
+template <int Channels>
+void BasicVCycle<Channels>::set_jacobi_blocking(size_t tile_size, int sweeps) {
+  if (tile_size == 0 || sweeps < 1) {
+    throw std::invalid_argument("invalid Jacobi blocking parameters");
+  }
+  check_blocking(tile_size, sweeps, smoother_);
+  jacobi_sweeps_ = sweeps;
+  if (tile_size != tile_size_) {
+    tile_size_ = tile_size;
+    if (!tile_stack.empty()) {
+      build_tile_stack();
+    }
+  }
+}
+
+// Jacobi caches a halo as deep as its sweeps plus one for the residual,
+// the launch of Gauss-Seidel that writes the residual one of two pixels.
+template <int Channels>
+void BasicVCycle<Channels>::check_blocking(size_t tile_size, int sweeps,
+                                           Smoother smoother) const {
+  if (max_work_group_size_ == 0) {
+    return;
+  }
+  std::ostringstream error;
+  size_t halo = smoother == JACOBI ? size_t(sweeps) + 1 : 2;
+  size_t cache_size = tile_size + 2 * halo;
+  cl_ulong local_mem = 2 * cache_size * cache_size * PIXEL_SIZE;
+  if (tile_size * tile_size > max_work_group_size_) {
+    error << "tiles of " << tile_size << "x" << tile_size
+          << " pixels exceed the maximum work-group size of "
+          << max_work_group_size_;
+  } else if (local_mem > local_mem_size_) {
+    error << "tiles of " << tile_size << "x" << tile_size << " pixels with a "
+          << halo << " pixel halo need " << local_mem
+          << " bytes of local memory, the device has " << local_mem_size_
+          << "; reduce the tile size or the Jacobi sweeps";
+  }
+  if (!error.str().empty()) {
+    throw std::invalid_argument(error.str());
+  }
+}
+
+template <int Channels>
+void BasicVCycle<Channels>::jacobi_iterations(int iterations, bool residual) {
+  size_t local_size = tile_size_;
+  size_t width = x1_stack[current_grid_].getImageInfo<CL_IMAGE_WIDTH>();
+  size_t height = x1_stack[current_grid_].getImageInfo<CL_IMAGE_HEIGHT>();
   for (int i = 0; i < iterations; ++i) {
+    // The last launch also writes the residual
+    cl_int write_residual = residual && i == iterations - 1;
+    size_t cache_size = local_size + 2 * size_t(jacobi_sweeps_ +
+                                                write_residual);
     jacobi.setArg<cl::Image2D>(0, b_stack[current_grid_]);
     jacobi.setArg<cl::Image2D>(1, x1_stack[current_grid_]);
     jacobi.setArg<cl::Image2D>(2, x2_stack[current_grid_]);
-    jacobi.setArg(3, (local_size + 2) *
-                     (local_size + 2) * sizeof(cl_float4), NULL);
-    queue_.enqueueNDRangeKernel(
-      jacobi,
-      cl::NullRange,
-      cl::NDRange(glob_width, glob_height),
-      cl::NDRange(local_size, local_size)
-    );
+    jacobi.setArg<cl::Image2D>(3, residual_stack[current_grid_]);
+    jacobi.setArg<cl_int>(4, jacobi_sweeps_);
+    jacobi.setArg<cl_int>(5, write_residual);
+    jacobi.setArg(6, cache_size * cache_size * PIXEL_SIZE, NULL);
+    jacobi.setArg(7, cache_size * cache_size * PIXEL_SIZE, NULL);
+    launch_tiled(jacobi, 8, current_grid_, local_size, local_size,
+                 width, height);
     std::swap(x1_stack[current_grid_], x2_stack[current_grid_]);
   }
-  // residual calculation
+  if (residual && iterations == 0) {
+    compute_residual();
+  }
+}
+
+template <int Channels>
+void BasicVCycle<Channels>::gauss_seidel_iterations(int iterations,
+                                                    bool reverse,
+                                                    bool residual) {
+  size_t width = x1_stack[current_grid_].getImageInfo<CL_IMAGE_WIDTH>();
+  size_t height = x1_stack[current_grid_].getImageInfo<CL_IMAGE_HEIGHT>();
+  // The finest grid has a five point stencil, coarser grids nine points
+  cl_int colours = current_grid_ == 0 ? 2 : 4;
+  size_t cache_size = tile_size_ + 4;
+
+  for (int i = 0; i < iterations; ++i) {
+    for (cl_int c = 0; c < colours; ++c) {
+      // The last launch also writes the residual
+      bool write_residual = residual && i == iterations - 1 &&
+                            c == colours - 1;
+      cl::Kernel& kernel = write_residual ? gauss_seidel_residual
+                                          : gauss_seidel;
+      kernel.setArg<cl::Image2D>(0, b_stack[current_grid_]);
+      cl_uint arg = set_solution_args(kernel, 1, current_grid_);
+      if (write_residual) {
+        kernel.setArg<cl::Image2D>(arg++, residual_stack[current_grid_]);
+      }
+      kernel.setArg<cl_int>(arg++, colours);
+      // Post-smoothing visits the colours in reverse order, which keeps the
+      // cycle symmetric.
+      kernel.setArg<cl_int>(arg++, reverse ? colours - 1 - c : c);
+      if (write_residual) {
+        kernel.setArg(arg++, cache_size * cache_size * PIXEL_SIZE, NULL);
+        kernel.setArg(arg++, cache_size * cache_size * PIXEL_SIZE, NULL);
+      }
+      launch_tiled(kernel, arg, current_grid_, tile_size_, tile_size_,
+                   width, height);
+      swap_solution(current_grid_);
+    }
+  }
+  if (residual && iterations == 0) {
+    compute_residual();
+  }
+}
+
+template <int Channels>
+void BasicVCycle<Channels>::smooth(int iterations, bool reverse,
+                                   bool residual) {
+  if (smoother_ == JACOBI) {
+    jacobi_iterations(iterations, residual);
+  } else {
+    gauss_seidel_iterations(iterations, reverse, residual);
+  }
+}
+
+template <int Channels>
+void BasicVCycle<Channels>::compute_residual() {
   calculate_residual.setArg<cl::Image2D>(0, b_stack[current_grid_]);
   calculate_residual.setArg<cl::Image2D>(1, x1_stack[current_grid_]);
   calculate_residual.setArg<cl::Image2D>(2, residual_stack[current_grid_]);
-  queue_.enqueueNDRangeKernel(
-    calculate_residual,
-    cl::NullRange,
-    cl::NDRange(x1_stack[current_grid_].getImageInfo<CL_IMAGE_WIDTH>(),
-                x1_stack[current_grid_].getImageInfo<CL_IMAGE_HEIGHT>()),
-    cl::NullRange
-  );
+  launch_tiled(calculate_residual, 3, current_grid_, tile_size_, tile_size_,
+               x1_stack[current_grid_].getImageInfo<CL_IMAGE_WIDTH>(),
+               x1_stack[current_grid_].getImageInfo<CL_IMAGE_HEIGHT>());
+}
+
+template <int Channels>
+void BasicVCycle<Channels>::set_smoothing_steps(std::vector<int> pre,
+                                       std::vector<int> post) {
+  if (pre.empty() || post.empty()) {
+    throw std::invalid_argument("smoothing steps must not be empty");
+  }
+  pre_smoothing_ = pre;
+  post_smoothing_ = post;
+}
+
+template <int Channels>
+void BasicVCycle<Channels>::set_smoother(Smoother smoother) {
+  check_blocking(tile_size_, jacobi_sweeps_, smoother);
+  smoother_ = smoother;
+  if (!in_place_) {
+    return;
+  }
+  // In place only Jacobi needs the second set of solution images
+  if (!ping_pong()) {
+    x2_stack.clear();
+  } else if (x2_stack.empty()) {
+    for (size_t i = 0; i < x1_stack.size(); ++i) {
+      x2_stack.push_back(cl::Image2D(
+          context_, CL_MEM_READ_WRITE,
+          x1_stack[i].getImageInfo<CL_IMAGE_FORMAT>(),
+          x1_stack[i].getImageInfo<CL_IMAGE_WIDTH>(),
+          x1_stack[i].getImageInfo<CL_IMAGE_HEIGHT>()));
+      launch_reset_image(false, x2_stack.back());
+    }
+  }
+}
+
+template <int Channels>
+cl_uint BasicVCycle<Channels>::set_solution_args(cl::Kernel& kernel,
+                                                 cl_uint arg, size_t level) {
+  kernel.setArg<cl::Image2D>(arg, x1_stack[level]);
+  if (in_place_) {
+    return arg + 1;
+  }
+  kernel.setArg<cl::Image2D>(arg + 1, x2_stack[level]);
+  return arg + 2;
+}
+
+template <int Channels>
+void BasicVCycle<Channels>::swap_solution(size_t level) {
+  if (!in_place_) {
+    std::swap(x1_stack[level], x2_stack[level]);
+  }
+}
+
+template <int Channels>
+void BasicVCycle<Channels>::set_smoothing_steps(int pre, int post) {
+  set_smoothing_steps(std::vector<int>(1, pre), std::vector<int>(1, post));
+}
+
+template <int Channels>
+int BasicVCycle<Channels>::smoothing_steps(
+    const std::vector<int>& steps) const {
+  return steps[std::min(current_grid_, steps.size() - 1)];
 }
 
-void SimpleVCycle::v_cycle(double number_iterations) {
+template <int Channels>
+void BasicVCycle<Channels>::multigrid_cycle(CycleType type) {
   if (current_grid_ == x1_stack.size() - 1) {
     return;
   }
-  jacobi_iterations(1);
+  smooth(smoothing_steps(pre_smoothing_), false, true);
   push_residual_stack();
-  v_cycle(number_iterations);
+  switch (type) {
+    case V_CYCLE:
+      multigrid_cycle(V_CYCLE);
+      break;
+    case W_CYCLE:
+      multigrid_cycle(W_CYCLE);
+      multigrid_cycle(W_CYCLE);
+      break;
+    case F_CYCLE:
+      multigrid_cycle(F_CYCLE);
+      multigrid_cycle(V_CYCLE);
+      break;
+    default:
+      break;
+  }
   pop_residual_stack();
-  jacobi_iterations(1);
+  // After post-smoothing only the residual of the finest grid is of
+  // interest, and only for monitoring
+  smooth(smoothing_steps(post_smoothing_), true,
+         current_grid_ == 0 && residual_monitoring_);
 }
-void SimpleVCycle::start_calculation_async(double number_iterations) {
-  // Jacobi iterations
-  v_cycle(number_iterations);
+
+template <int Channels>
+void BasicVCycle<Channels>::full_multigrid() {
+  // Restrict the right hand side of the finest grid down the whole pyramid
+  current_grid_ = 0;
+  for (; current_grid_ < b_stack.size() - 1; ++current_grid_) {
+    restrict_image(b_stack[current_grid_], current_grid_ + 1);
+  }
+  for (size_t i = 0; i < x1_stack.size(); ++i) {
+    launch_reset_image(false, x1_stack[i]);
+    if (!x2_stack.empty()) {
+      launch_reset_image(false, x2_stack[i]);
+    }
+  }
+  // Solve on the coarsest grid, then interpolate the solution upwards and
+  // improve it with one cycle on each finer grid.
+  smooth(COARSEST_ITERATIONS, false, false);
+  while (current_grid_ > 0) {
+    pop_residual_stack();
+    multigrid_cycle(cycle_type_);
+  }
 }
 
-void SimpleVCycle::push_residual_stack() {
-  ++current_grid_;
+template <int Channels>
+void BasicVCycle<Channels>::start_calculation_async(double number_iterations) {
+  for (int i = 0; i < int(number_iterations); ++i) {
+    if (full_multigrid_ && fmg_pending_) {
+      fmg_pending_ = false;
+      full_multigrid();
+    } else {
+      multigrid_cycle(cycle_type_);
+    }
+  }
+}
 
-  bilinear_restrict.setArg<cl::Image2D>(0, residual_stack[current_grid_ - 1]);
-  bilinear_restrict.setArg<cl::Image2D>(1, b_stack[current_grid_]);
+template <int Channels>
+void BasicVCycle<Channels>::copy_solution(const cl::Image2D& image) {
+  copy_image.setArg<cl::Image2D>(0, x1_stack[0]);
+  copy_image.setArg<cl::Image2D>(1, image);
   queue_.enqueueNDRangeKernel(
-    bilinear_restrict,
+    copy_image,
     cl::NullRange,
-    cl::NDRange(b_stack[current_grid_].getImageInfo<CL_IMAGE_WIDTH>(),
-                b_stack[current_grid_].getImageInfo<CL_IMAGE_HEIGHT>()),
+    cl::NDRange(x1_stack[0].getImageInfo<CL_IMAGE_WIDTH>(),
+                x1_stack[0].getImageInfo<CL_IMAGE_HEIGHT>()),
     cl::NullRange
   );
-  launch_reset_image(false, residual_stack[current_grid_]);
-  launch_reset_image(false, x1_stack[current_grid_]);
-  launch_reset_image(false, x2_stack[current_grid_]);
 }
 
-void SimpleVCycle::pop_residual_stack() {
-  if (current_grid_ > 0) {
-    --current_grid_;
+template <int Channels>
+void BasicVCycle<Channels>::precondition(const cl::Image2D& rhs) {
+  // rhs may be stored in another format than b, so it is copied by a kernel
+  copy_image.setArg<cl::Image2D>(0, rhs);
+  copy_image.setArg<cl::Image2D>(1, b_stack[0]);
+  queue_.enqueueNDRangeKernel(
+    copy_image,
+    cl::NullRange,
+    cl::NDRange(b_stack[0].getImageInfo<CL_IMAGE_WIDTH>(),
+                b_stack[0].getImageInfo<CL_IMAGE_HEIGHT>()),
+    cl::NullRange
+  );
+  rhs_replaced_ = true;
 
-    cl::Image2D cl_x1_copy(context_, CL_MEM_READ_WRITE,
-                           cl::ImageFormat(CL_RGBA, X_CL_TYPE),
-                           x1_stack[current_grid_].getImageInfo<CL_IMAGE_WIDTH>(),
-                           x1_stack[current_grid_].getImageInfo<CL_IMAGE_HEIGHT>());
+  launch_reset_image(false, x1_stack[0]);
+  if (!x2_stack.empty()) {
+    launch_reset_image(false, x2_stack[0]);
+  }
+  current_grid_ = 0;
+  // Nobody looks at the residual of the preconditioner
+  bool monitoring = residual_monitoring_;
+  residual_monitoring_ = false;
+  multigrid_cycle(cycle_type_);
+  residual_monitoring_ = monitoring;
+}
 
-    bilinear_interp.setArg<cl::Image2D>(0, x1_stack[current_grid_ + 1]);
-    bilinear_interp.setArg<cl::Image2D>(1, cl_x1_copy);
-    cl::Event ev;
-    queue_.enqueueNDRangeKernel(
-      bilinear_interp,
-      cl::NullRange,
-      cl::NDRange(cl_x1_copy.getImageInfo<CL_IMAGE_WIDTH>(),
-                  cl_x1_copy.getImageInfo<CL_IMAGE_HEIGHT>()),
-      cl::NullRange
-    );
+template <int Channels>
+void BasicVCycle<Channels>::restrict_image(const cl::Image2D& fine,
+                                           size_t level) {
+  const cl::Image2D& coarse = b_stack[level];
+  bilinear_restrict.setArg<cl::Image2D>(0, fine);
+  bilinear_restrict.setArg<cl::Image2D>(1, coarse);
+  launch_tiled(bilinear_restrict, 2, level, tile_size_, tile_size_,
+               coarse.getImageInfo<CL_IMAGE_WIDTH>(),
+               coarse.getImageInfo<CL_IMAGE_HEIGHT>());
+}
 
-    cl::Image2D cl_current_x1_copy(context_, CL_MEM_READ_WRITE,
-                        cl::ImageFormat(CL_RGBA, X_CL_TYPE),
-                        x1_stack[current_grid_].getImageInfo<CL_IMAGE_WIDTH>(),
-                        x1_stack[current_grid_].getImageInfo<CL_IMAGE_HEIGHT>());
-    cl::size_t<3> size;
-    size.push_back(x1_stack[current_grid_].getImageInfo<CL_IMAGE_WIDTH>());
-    size.push_back(x1_stack[current_grid_].getImageInfo<CL_IMAGE_HEIGHT>());
-    size.push_back(1);
-    queue_.enqueueCopyImage(x1_stack[current_grid_], cl_current_x1_copy,
-                            origin_, origin_, size);
-
-    add_images.setArg<cl::Image2D>(0, cl_current_x1_copy);
-    add_images.setArg<cl::Image2D>(1, cl_x1_copy);
-    add_images.setArg<cl::Image2D>(2, b_stack[current_grid_]);
-    add_images.setArg<cl::Image2D>(3, x1_stack[current_grid_]);
-    queue_.enqueueNDRangeKernel(
-      add_images,
-      cl::NullRange,
-      cl::NDRange(x1_stack[current_grid_].getImageInfo<CL_IMAGE_WIDTH>(),
-                  x1_stack[current_grid_].getImageInfo<CL_IMAGE_HEIGHT>()),
-      cl::NullRange
-    );
+template <int Channels>
+void BasicVCycle<Channels>::push_residual_stack() {
+  ++current_grid_;
+
+  restrict_image(residual_stack[current_grid_ - 1], current_grid_);
+  // Pixels outside the active tiles are never written after the images
+  // have been allocated, so only the active tiles need to be reset.
+  size_t width = b_stack[current_grid_].getImageInfo<CL_IMAGE_WIDTH>();
+  size_t height = b_stack[current_grid_].getImageInfo<CL_IMAGE_HEIGHT>();
+  std::vector<cl::Image2D*> images;
+  images.push_back(&residual_stack[current_grid_]);
+  images.push_back(&x1_stack[current_grid_]);
+  if (!x2_stack.empty()) {
+    images.push_back(&x2_stack[current_grid_]);
+  }
+  for (size_t i = 0; i < images.size(); ++i) {
+    reset_image.setArg<cl::Image2D>(0, *images[i]);
+    launch_tiled(reset_image, 1, current_grid_, tile_size_, tile_size_,
+                 width, height);
   }
 }
 
-void SimpleVCycle::build_multigrid(bool initialize) {
+template <int Channels>
+void BasicVCycle<Channels>::pop_residual_stack() {
+  if (current_grid_ > 0) {
+    --current_grid_;
+
+    interp_add.setArg<cl::Image2D>(0, x1_stack[current_grid_ + 1]);
+    interp_add.setArg<cl::Image2D>(1, b_stack[current_grid_]);
+    cl_uint arg = set_solution_args(interp_add, 2, current_grid_);
+    launch_tiled(interp_add, arg, current_grid_, tile_size_, tile_size_,
+                 x1_stack[current_grid_].getImageInfo<CL_IMAGE_WIDTH>(),
+                 x1_stack[current_grid_].getImageInfo<CL_IMAGE_HEIGHT>());
+    swap_solution(current_grid_);
+  }
+}
+
+template <int Channels>
+void BasicVCycle<Channels>::build_multigrid() {
   size_t current_width = b_stack[0].getImageInfo<CL_IMAGE_WIDTH>();
   size_t current_height = b_stack[0].getImageInfo<CL_IMAGE_HEIGHT>();
-  if (initialize) {
-    b_stack.resize(1);
-    x1_stack.resize(1);
+  b_stack.resize(1);
+  x1_stack.resize(1);
+  if (!x2_stack.empty()) {
     x2_stack.resize(1);
-    residual_stack.resize(1);
   }
+  residual_stack.resize(1);
   while (current_height != 1 && current_width != 1) {
     current_width = (current_width + 1) / 2;
     current_height = (current_height + 1) / 2;
-    if (initialize) {
-      b_stack.push_back(cl::Image2D(context_, CL_MEM_READ_WRITE,
-                                    cl::ImageFormat(CL_RGBA, CL_FLOAT),
-                                    current_width, current_height));
-      x1_stack.push_back(cl::Image2D(context_, CL_MEM_READ_WRITE,
-                                     cl::ImageFormat(CL_RGBA, X_CL_TYPE),
-                                     current_width, current_height));
-      x2_stack.push_back(cl::Image2D(context_, CL_MEM_READ_WRITE,
-                                     cl::ImageFormat(CL_RGBA, X_CL_TYPE),
+    cl::ImageFormat format = level_format(b_stack.size());
+    b_stack.push_back(cl::Image2D(context_, CL_MEM_READ_WRITE, format,
+                                  current_width, current_height));
+    x1_stack.push_back(cl::Image2D(context_, CL_MEM_READ_WRITE, format,
+                                   current_width, current_height));
+    if (!x2_stack.empty()) {
+      x2_stack.push_back(cl::Image2D(context_, CL_MEM_READ_WRITE, format,
                                      current_width, current_height));
-      residual_stack.push_back(cl::Image2D(context_, CL_MEM_READ_WRITE,
-                                           cl::ImageFormat(CL_RGBA, CL_FLOAT),
-                                           current_width, current_height));
+      launch_reset_image(false, x2_stack.back());
     }
+    residual_stack.push_back(cl::Image2D(context_, CL_MEM_READ_WRITE, format,
+                                         current_width, current_height));
+    launch_reset_image(false, x1_stack.back());
+    launch_reset_image(false, residual_stack.back());
+  }
+  // The masks of the coarse grids are those of the restricted b
+  for (size_t i = 1; i < b_stack.size(); ++i) {
+    restrict_image(b_stack[i - 1], i);
   }
+  build_tile_stack();
 }
 
-void SimpleVCycle::setup_new_system(bool initialize) {
-  setup_system.setArg<cl::Image2D>(0, cl_source_);
-  setup_system.setArg<cl::Image2D>(1, cl_target_);
-  setup_system.setArg<cl::Image2D>(2, b_stack[0]);
-  setup_system.setArg<cl::Image2D>(3, x1_stack[0]);
-  setup_system.setArg<cl_int>(4, pos_x_);
-  setup_system.setArg<cl_int>(5, pos_y_);
-  setup_system.setArg<cl_int>(6, initialize);
+template <int Channels>
+void BasicVCycle<Channels>::build_tile_stack() {
+  tile_stack.clear();
+  tile_count_stack.clear();
+  cl::Buffer count(context_, CL_MEM_READ_WRITE, sizeof(cl_int));
+  for (size_t i = 0; i < b_stack.size(); ++i) {
+    size_t width = b_stack[i].getImageInfo<CL_IMAGE_WIDTH>();
+    size_t height = b_stack[i].getImageInfo<CL_IMAGE_HEIGHT>();
+    size_t tiles_x = (width + tile_size_ - 1) / tile_size_;
+    size_t tiles_y = (height + tile_size_ - 1) / tile_size_;
+    cl::Buffer tiles(context_, CL_MEM_READ_WRITE,
+                     tiles_x * tiles_y * sizeof(cl_int2));
+    cl_int active = 0;
+    queue_.enqueueWriteBuffer(count, CL_TRUE, 0, sizeof(cl_int), &active);
+    collect_active_tiles.setArg<cl::Image2D>(0, b_stack[i]);
+    collect_active_tiles.setArg(1, sizeof(cl_int), NULL);
+    collect_active_tiles.setArg<cl::Buffer>(2, count);
+    collect_active_tiles.setArg<cl::Buffer>(3, tiles);
+    queue_.enqueueNDRangeKernel(
+      collect_active_tiles,
+      cl::NullRange,
+      cl::NDRange(tiles_x * tile_size_, tiles_y * tile_size_),
+      cl::NDRange(tile_size_, tile_size_)
+    );
+    queue_.enqueueReadBuffer(count, CL_TRUE, 0, sizeof(cl_int), &active);
+    tile_stack.push_back(tiles);
+    tile_count_stack.push_back(size_t(active));
+  }
+}
 
-  queue_.enqueueNDRangeKernel(
-    setup_system,
-    cl::NullRange,
-    cl::NDRange(cl_source_.getImageInfo<CL_IMAGE_WIDTH>(),
-                cl_source_.getImageInfo<CL_IMAGE_HEIGHT>()),
-    cl::NullRange
-  );
+// The source part of b only changes with a new system, after that only the
+// equations next to the boundary are rewritten for the target and offset.
+template <int Channels>
+void BasicVCycle<Channels>::setup_new_system(bool initialize) {
+  if (initialize || rhs_replaced_) {
+    setup_guidance.setArg<cl::Image2D>(0, cl_source_);
+    setup_guidance.setArg<cl::Image2D>(1, b_stack[0]);
+    setup_guidance.setArg<cl::Image2D>(2, x1_stack[0]);
+    setup_guidance.setArg<cl_int>(3, initialize);
+    queue_.enqueueNDRangeKernel(
+      setup_guidance,
+      cl::NullRange,
+      cl::NDRange(cl_source_.getImageInfo<CL_IMAGE_WIDTH>(),
+                  cl_source_.getImageInfo<CL_IMAGE_HEIGHT>()),
+      cl::NullRange
+    );
+    rhs_replaced_ = false;
+  }
+
+  if (!rim_.empty()) {
+    update_boundary.setArg<cl::Image2D>(0, cl_source_);
+    update_boundary.setArg<cl::Image2D>(1, cl_target_);
+    update_boundary.setArg<cl::Image2D>(2, b_stack[0]);
+    update_boundary.setArg<cl::Buffer>(3, rim_pixels_);
+    update_boundary.setArg<cl_int>(4, pos_x_ + domain_x_);
+    update_boundary.setArg<cl_int>(5, pos_y_ + domain_y_);
+    queue_.enqueueNDRangeKernel(
+      update_boundary,
+      cl::NullRange,
+      cl::NDRange(rim_.size()),
+      cl::NullRange
+    );
+  }
+  if (initialize) {
+    fmg_pending_ = true;
+  }
+}
+
+template <int Channels>
+void BasicVCycle<Channels>::next_frame(cv::Mat target) {
+  Solver::set_target(target);
+  setup_new_system(false);
 }
 
-void SimpleVCycle::set_offset(int off_x, int off_y) {
+template <int Channels>
+void BasicVCycle<Channels>::set_offset(int off_x, int off_y) {
+  int old_x = pos_x_;
+  int old_y = pos_y_;
   Solver::set_offset(off_x, off_y);
+  // The solution is the source plus a membrane through the boundary values.
+  // Moving the membrane by a plane fitted to the change of the boundary
+  // values resumes close to the new solution, where the cycles would
+  // otherwise have to smooth the jump away first.
+  cl_float4 a, b, c;
+  if (!b_stack.empty() && fit_boundary_change(old_x, old_y, a, b, c)) {
+    launch_add_plane(a, b, c);
+  }
   setup_new_system(false);
-  build_multigrid(false);
 }
 
-void SimpleVCycle::launch_reset_image(bool block, cl::Image2D image) {
+template <int Channels>
+void BasicVCycle<Channels>::launch_reset_image(bool block, cl::Image2D image) {
   cl::Event ev;
   reset_image.setArg<cl::Image2D>(0, image);
+  reset_image.setArg<cl::Buffer>(1, cl::Buffer());
   queue_.enqueueNDRangeKernel(
     reset_image,
     cl::NullRange,
@@ -290,4 +865,52 @@ void SimpleVCycle::launch_reset_image(bool block, cl::Image2D image) {
   }
 }
 
+// Launches kernel with one work-group of local_width x local_height per active
+// tile of the grid level. Grids without a tile list yet get a launch over the
+// whole width x height domain of the kernel instead.
+template <int Channels>
+void BasicVCycle<Channels>::launch_tiled(cl::Kernel& kernel, cl_uint tiles_arg,
+                                size_t level,
+                                size_t local_width, size_t local_height,
+                                size_t width, size_t height) {
+  if (level < tile_stack.size()) {
+    if (tile_count_stack[level] == 0) {
+      return;
+    }
+    kernel.setArg<cl::Buffer>(tiles_arg, tile_stack[level]);
+    queue_.enqueueNDRangeKernel(
+      kernel,
+      cl::NullRange,
+      cl::NDRange(tile_count_stack[level] * local_width, local_height),
+      cl::NDRange(local_width, local_height)
+    );
+  } else {
+    kernel.setArg<cl::Buffer>(tiles_arg, cl::Buffer());
+    queue_.enqueueNDRangeKernel(
+      kernel,
+      cl::NullRange,
+      cl::NDRange((width + local_width - 1) / local_width * local_width,
+                  (height + local_height - 1) / local_height * local_height),
+      cl::NDRange(local_width, local_height)
+    );
+  }
+}
+
+template <int Channels>
+void BasicVCycle<Channels>::launch_add_plane(cl_float4 a, cl_float4 b,
+                                             cl_float4 c) {
+  add_plane.setArg<cl::Image2D>(0, b_stack[0]);
+  cl_uint arg = set_solution_args(add_plane, 1, 0);
+  add_plane.setArg<cl_float4>(arg, a);
+  add_plane.setArg<cl_float4>(arg + 1, b);
+  add_plane.setArg<cl_float4>(arg + 2, c);
+  launch_tiled(add_plane, arg + 3, 0, tile_size_, tile_size_,
+               b_stack[0].getImageInfo<CL_IMAGE_WIDTH>(),
+               b_stack[0].getImageInfo<CL_IMAGE_HEIGHT>());
+  swap_solution(0);
+}
+
+template class BasicVCycle<1>;
+template class BasicVCycle<3>;
+
 }
@@ -11,52 +11,217 @@
 
 namespace pv {
 
-class SimpleVCycle : public Solver {
+// Options and results shared by all instantiations of BasicVCycle
+class VCycleBase : public Solver {
  public:
-  SimpleVCycle();
+  enum CycleType { V_CYCLE, W_CYCLE, F_CYCLE };
+  enum Smoother { JACOBI, GAUSS_SEIDEL };
+  enum Precision { FULL_PRECISION, HALF_COARSE_GRIDS, HALF_PRECISION };
+
+  // Per channel norms of the residual of the finest grid
+  struct ResidualNorms {
+    cl_float4 l2;
+    cl_float4 max;
+    float average;  // what get_residual_average() returns
+  };
+
+ protected:
+  // Residual norms reduced on the device into a mapped buffer
+  struct ResidualQuery {
+    ResidualQuery() : ready(), result(), value(), nr_pixels() {}
+    cl::Event ready;
+    cl::Buffer result;
+    cl_float4* value;
+    size_t nr_pixels;
+  };
+};
+
+// Multigrid solver for Channels colour channels, 1 (grayscale) or 3 (RGB).
+// The kernels are compiled for the channel count and the grids store the
+// channels plus the grid spacing, as CL_RG for grayscale and CL_RGBA for RGB.
+// Devices without float CL_RG images get grayscale grids in CL_RGBA.
+template <int Channels>
+class BasicVCycle : public VCycleBase {
+  static_assert(Channels == 1 || Channels == 3,
+                "only grayscale and RGB grids are supported");
+
+ public:
+  BasicVCycle();
 
   void set_source(cv::Mat source, cv::Mat mask);
   void set_target(cv::Mat target);
+  void next_frame(cv::Mat target);
 
   void init(cl::Context context, cl::CommandQueue queue);
   void set_offset(int off_x, int off_y);
 
   void start_calculation_async(double number_iterations);
+
   float get_residual_average();
+  float get_residual_average_async();
+  ResidualNorms get_residual_norms();
+  // Norms of another image of the finest grid's size and storage, e.g. the
+  // residual of a solver wrapped around this one
+  ResidualNorms get_norms(const cl::Image2D& image);
+  // Enqueues the per channel sums of lhs * rhs, two images of the finest
+  // grid's size, into the first cl_float4 of result, which needs room for
+  // two. Nothing is read back, so the sums can feed further kernels.
+  void enqueue_dot_product(const cl::Image2D& lhs, const cl::Image2D& rhs,
+                           const cl::Buffer& result);
+  int solve_until(float tolerance, int max_cycles);
+
+  // When enabled, the first cycle after a new system has been set up is a
+  // full multigrid pass (coarsest grid first, then interpolated upwards)
+  // instead of a V-cycle starting from the source pixels.
+  void set_full_multigrid(bool enabled) { full_multigrid_ = enabled; }
+
+  void set_cycle_type(CycleType type) { cycle_type_ = type; }
+  // Number of smoothing iterations before and after the coarse grid
+  // correction. Entry i applies to grid i, the last entry to all coarser
+  // grids.
+  void set_smoothing_steps(std::vector<int> pre, std::vector<int> post);
+  void set_smoothing_steps(int pre, int post);
+  // Jacobi writes every sweep into a second set of solution images and swaps
+  // the sets. Gauss-Seidel, the prolongation and set_offset() do so too on
+  // devices without OpenCL C 2.0 read_write images, elsewhere they update
+  // the solution in place and Gauss-Seidel needs no second set.
+  void set_smoother(Smoother smoother);
+  // Work-group tile edge length and number of sweeps each Jacobi launch does
+  // out of local memory. Local memory use grows with (tile + 2 * sweeps)^2.
+  // The per pixel kernels of all smoothers are launched over the active tiles
+  // of this size. The default of 16x16 tiles and 10 sweeps is what the Jacobi
+  // kernel always did, and needs 45 KB of local memory with RGB grids.
+  // Throws std::invalid_argument if the tiles exceed the maximum work-group
+  // size of the device or the caches of the smoother its local memory, here
+  // or, for the defaults, in init().
+  void set_jacobi_blocking(size_t tile_size, int sweeps);
+  // Without monitoring the residual of the finest grid is not recalculated
+  // after post-smoothing, and get_residual_average(), solve_until() and
+  // current_residual() see the residual from before the coarse grid
+  // correction.
+  void set_residual_monitoring(bool enabled) { residual_monitoring_ = enabled; }
+  // Storage format of the b, x and residual images, the kernels always
+  // compute in float. HALF_COARSE_GRIDS stores all grids but the finest as
+  // CL_HALF_FLOAT, HALF_PRECISION all of them. Devices without half float
+  // images keep using float. Applies to the images allocated by the next
+  // set_source() and set_target().
+  void set_precision(Precision precision) { precision_ = precision; }
+
+  // Approximately solves the system for the right hand side rhs with one
+  // cycle starting from zero and leaves the result in current_solution().
+  // This overwrites the system set up by set_target() until the next
+  // set_offset() or next_frame().
+  void precondition(const cl::Image2D& rhs);
 
   const cl::Image2D& current_solution() { return x1_stack[0]; }
   const cl::Image2D& current_residual() { return residual_stack[0]; }
+  const cl::Image2D& current_rhs() { return b_stack[0]; }
+  // Copies current_solution() into image of the same size, converting it to
+  // the format of image, e.g. from the half floats of HALF_PRECISION
+  void copy_solution(const cl::Image2D& image);
 
  private:
-  static const int X_CL_TYPE = CL_FLOAT;
+  static const cl_channel_order CHANNEL_ORDER = Channels == 1 ? CL_RG
+                                                              : CL_RGBA;
+  static const size_t PIXEL_SIZE = (Channels + 1) * sizeof(cl_float);
+  static const int COARSEST_ITERATIONS = 4;
+  static const int RESIDUAL_CHECK_INTERVAL = 2;
+  static const size_t REDUCE_TILE_SIZE = 16;
+
+  ResidualQuery enqueue_residual_query();
+  ResidualQuery enqueue_norms_query(const cl::Image2D& image);
+  ResidualNorms finish_residual_query(const ResidualQuery& query);
+  void enqueue_reduction(cl::Kernel& first_stage, cl_uint arg,
+                         size_t width, size_t height,
+                         const cl::Buffer& result);
 
-  void jacobi_iterations(int iterations);
-  void v_cycle(double number_iterations);
+  void smooth(int iterations, bool reverse, bool residual);
+  void jacobi_iterations(int iterations, bool residual);
+  void gauss_seidel_iterations(int iterations, bool reverse, bool residual);
+  void compute_residual();
+  void multigrid_cycle(CycleType type);
+  int smoothing_steps(const std::vector<int>& steps) const;
+  void full_multigrid();
   void setup_new_system(bool initialize);
-  void build_multigrid(bool initialize);
+  void build_multigrid();
   void push_residual_stack();
   void pop_residual_stack();
+  void restrict_image(const cl::Image2D& fine, size_t level);
+  void build_tile_stack();
+  cl::ImageFormat level_format(size_t level) const;
+  void check_blocking(size_t tile_size, int sweeps, Smoother smoother) const;
+  bool ping_pong() const { return !in_place_ || smoother_ == JACOBI; }
+  // Sets the solution arguments of a kernel taking SOLUTION_ARGS, starting
+  // at arg, and returns the index of the argument after them
+  cl_uint set_solution_args(cl::Kernel& kernel, cl_uint arg, size_t level);
+  void swap_solution(size_t level);
 
   cl::Program program_;
   cl::Kernel jacobi;
+  cl::Kernel gauss_seidel;
+  cl::Kernel gauss_seidel_residual;
   cl::Kernel calculate_residual;
-  cl::Kernel setup_system;
+  cl::Kernel setup_guidance;
+  cl::Kernel update_boundary;
   cl::Kernel reset_image;
-  cl::Kernel reduce;
+  cl::Kernel reduce_norms;
+  cl::Kernel reduce_products;
+  cl::Kernel reduce_norms_partial;
   cl::Kernel copy_xyz;
-  cl::Kernel add_images;
-  cl::Kernel bilinear_interp;
+  cl::Kernel interp_add;
   cl::Kernel bilinear_restrict;
+  cl::Kernel collect_active_tiles;
+  cl::Kernel copy_image;
+  cl::Kernel add_plane;
+  // cl_int2 coordinates of Solver::rim_
+  cl::Buffer rim_pixels_;
+  // precondition() has replaced the source part of b
+  bool rhs_replaced_;
   std::vector<cl::Image2D> b_stack;
   std::vector<cl::Image2D> x1_stack;
   std::vector<cl::Image2D> x2_stack;
   std::vector<cl::Image2D> residual_stack;
+  // Per grid list of the tiles that contain pixels inside the mask
+  std::vector<cl::Buffer> tile_stack;
+  std::vector<size_t> tile_count_stack;
   size_t current_grid_;
+  bool full_multigrid_;
+  bool fmg_pending_;
+  CycleType cycle_type_;
+  std::vector<int> pre_smoothing_;
+  std::vector<int> post_smoothing_;
+  Smoother smoother_;
+  bool residual_monitoring_;
+  size_t tile_size_;
+  cl_int jacobi_sweeps_;
+  Precision precision_;
+  // CHANNEL_ORDER, or CL_RGBA where the device has no float images of that
+  // order. The kernels read and write the first channels either way.
+  cl_channel_order channel_order_;
+  bool half_supported_;
+  // The kernels update the solution in read_write images
+  bool in_place_;
+  // Limits of the device, 0 until init()
+  size_t max_work_group_size_;
+  cl_ulong local_mem_size_;
+  cl::Buffer residual_partials_[2];
+  size_t residual_partials_capacity_;
+  std::vector<cl::Buffer> residual_results_;
+  ResidualQuery pending_query_;
+  bool residual_query_pending_;
+  float last_residual_average_;
 
   // kernel launchers
   void launch_reset_image(bool block, cl::Image2D image);
+  void launch_add_plane(cl_float4 a, cl_float4 b, cl_float4 c);
+  void launch_tiled(cl::Kernel& kernel, cl_uint tiles_arg, size_t level,
+                    size_t local_width, size_t local_height,
+                    size_t width, size_t height);
 };
 
+typedef BasicVCycle<3> SimpleVCycle;
+typedef BasicVCycle<1> GrayscaleVCycle;
+
 }
 
 #endif
@@ -70,7 +70,7 @@ void GLWidget::paintGL() {
   static int time_interval;
   static double fps;
 
-  float average = context_->solver()->get_residual_average();
+  float average = context_->solver()->get_residual_average_async();
   context_->draw_frame();
   context_->lock_gl();
   context_->solver()->start_calculation_async(1);
@@ -1,8 +1,11 @@
-#include "opencl.h"
 #include "gl_context.h"
+#include "opencl.h"
+#include "planar.h"
 
 #include <iostream>
 
+#include <GL/glx.h>
+
 namespace pv {
 
 GLContext::GLContext()
@@ -37,7 +40,15 @@ void GLContext::init() {
   glEnable(GL_DEPTH_TEST);
   glLoadIdentity();
 
-  pv::init_cl(gl_context_, queue_, true);
+  cl_context_properties sharing[] = {
+    CL_GLX_DISPLAY_KHR, cl_context_properties(glXGetCurrentDisplay()),
+    CL_GL_CONTEXT_KHR, cl_context_properties(glXGetCurrentContext()),
+    0
+  };
+  // Image access is emulated on CPU devices, the planar solver uses buffers
+  if (pv::init_cl(gl_context_, queue_, sharing) == CL_DEVICE_TYPE_CPU) {
+    solver_.reset(new PlanarVCycle);
+  }
   solver_->init(gl_context_, queue_);
 
   gl_kernels_ = pv::load_program(gl_context_, "gl_kernels");
@@ -46,13 +57,17 @@ void GLContext::init() {
 }
 
 void GLContext::set_source(cv::Mat source, cv::Mat mask) {
-  g_texture = load_texture(cv::Mat(), source.cols, source.rows);
-  g_residual = load_texture(cv::Mat(), source.cols, source.rows);
+  solver_->set_source(source, mask);
+
+  // The solver only keeps the part of the source around the mask
+  int x, y, width, height;
+  solver_->get_domain(x, y, width, height);
+  g_texture = load_texture(cv::Mat(), width, height);
+  g_residual = load_texture(cv::Mat(), width, height);
   cl_g_render = cl::Image2DGL(gl_context_, CL_MEM_WRITE_ONLY,
                               GL_TEXTURE_2D, 0, g_texture);
   cl_g_residual = cl::Image2DGL(gl_context_, CL_MEM_WRITE_ONLY,
                                 GL_TEXTURE_2D, 0, g_residual);
-  solver_->set_source(source, mask);
 }
 
 void GLContext::set_target(cv::Mat target) {
@@ -76,6 +91,10 @@ void GLContext::draw_frame() {
 
   int pos_x, pos_y;
   solver_->get_offset(pos_x, pos_y);
+  int domain_x, domain_y, domain_width, domain_height;
+  solver_->get_domain(domain_x, domain_y, domain_width, domain_height);
+  pos_x += domain_x;
+  pos_y += domain_y;
 
   glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
   glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
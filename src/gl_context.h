@@ -1,6 +1,9 @@
 #ifndef GL_CONTEXT_H_
 #define GL_CONTEXT_H_
 
+// GLEW has to come before any other GL header
+#include <GL/glew.h>
+
 #include <memory>
 
 #include "context.h"
@@ -0,0 +1,48 @@
+#include "image.h"
+
+#include <algorithm>
+#include <array>
+
+namespace pv {
+
+cv::Mat make_rgba(const cv::Mat& image, cv::Mat alpha) {
+  if (alpha.empty()) {
+    alpha = cv::Mat(cv::Mat::ones(image.size(), CV_8U) * 255);
+  }
+  if (image.channels() == 1) {
+    // Grayscale ends up in all three colour channels
+    cv::Mat bgr;
+    cv::cvtColor(image, bgr, CV_GRAY2BGR);
+    return make_rgba(bgr, alpha);
+  }
+  static int fromto[] = {0, 2,  1, 1,  2, 0,  3, 3};
+  cv::Mat with_alpha(image.size(), CV_8UC4);
+  std::array<cv::Mat, 2> images{{image, alpha}};
+  cv::mixChannels(images.data(), int(images.size()), &with_alpha, 1, fromto, 4);
+  return with_alpha;
+}
+
+cv::Rect mask_bounding_box(const cv::Mat& rgba, int border) {
+  int min_x = rgba.cols, min_y = rgba.rows, max_x = -1, max_y = -1;
+  for (int y = 0; y < rgba.rows; ++y) {
+    const cv::Vec4b* row = rgba.ptr<cv::Vec4b>(y);
+    for (int x = 0; x < rgba.cols; ++x) {
+      if (row[x][3]) {
+        min_x = std::min(min_x, x);
+        max_x = std::max(max_x, x);
+        min_y = std::min(min_y, y);
+        max_y = std::max(max_y, y);
+      }
+    }
+  }
+  if (max_x < 0) {
+    return cv::Rect(0, 0, rgba.cols, rgba.rows);
+  }
+  min_x = std::max(min_x - border, 0);
+  min_y = std::max(min_y - border, 0);
+  max_x = std::min(max_x + border, rgba.cols - 1);
+  max_y = std::min(max_y + border, rgba.rows - 1);
+  return cv::Rect(min_x, min_y, max_x - min_x + 1, max_y - min_y + 1);
+}
+
+}
@@ -0,0 +1,16 @@
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <cv.h>
+
+namespace pv {
+
+cv::Mat make_rgba(const cv::Mat& image, cv::Mat alpha = cv::Mat());
+// Bounding box of the pixels of an RGBA image with nonzero alpha, grown by
+// border pixels on each side and clipped to the image. The whole image if
+// no pixel has alpha.
+cv::Rect mask_bounding_box(const cv::Mat& rgba, int border);
+
+}
+
+#endif  // IMAGE_H_
@@ -4,6 +4,52 @@ const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |
                           CLK_FILTER_NEAREST |
                           CLK_ADDRESS_CLAMP_TO_EDGE;
 
+// A pixel of the grids holds PIXEL_CHANNELS colour channels followed by the
+// grid spacing h of its grid inside the mask and 0 outside (255 in the
+// solution). Grayscale grids are stored as CL_RG, RGB grids as CL_RGBA.
+#ifndef PIXEL_CHANNELS
+#define PIXEL_CHANNELS 3
+#endif
+
+#if PIXEL_CHANNELS == 1
+typedef float2 pixel_t;
+#define SPACING y
+#define read_pixel(image, s, coord) read_imagef(image, s, coord).xy
+#define write_pixel(image, coord, value) \
+    write_imagef(image, coord, (float4)((value), 0.0f, 0.0f))
+#define pixel_from_float4(value) ((value).xw)
+#define colour_float4(value) ((float4)((value).x, 0.0f, 0.0f, 0.0f))
+#else
+typedef float4 pixel_t;
+#define SPACING w
+#define read_pixel(image, s, coord) read_imagef(image, s, coord)
+#define write_pixel(image, coord, value) write_imagef(image, coord, value)
+#define pixel_from_float4(value) (value)
+#define colour_float4(value) ((float4)((value).xyz, 0.0f))
+#endif
+
+// Kernels that update the solution take SOLUTION_ARGS. With OpenCL C 2.0
+// read_write images they update x in place. Otherwise they read x_in and
+// write x_out, which the host swaps with x_in afterwards. read_write images
+// have no sampler, so the coordinates are clamped to the edge by hand.
+#ifdef READ_WRITE_IMAGES
+#define SOLUTION_ARGS read_write image2d_t x
+#define solution_dim() get_image_dim(x)
+#define read_solution(coord) \
+    read_pixel_rw(x, clamp((coord), (int2)(0), get_image_dim(x) - (int2)(1)))
+#define write_solution(coord, value) write_pixel(x, coord, value)
+#if PIXEL_CHANNELS == 1
+#define read_pixel_rw(image, coord) read_imagef(image, coord).xy
+#else
+#define read_pixel_rw(image, coord) read_imagef(image, coord)
+#endif
+#else
+#define SOLUTION_ARGS read_only image2d_t x_in, write_only image2d_t x_out
+#define solution_dim() get_image_dim(x_in)
+#define read_solution(coord) read_pixel(x_in, sampler, coord)
+#define write_solution(coord, value) write_pixel(x_out, coord, value)
+#endif
+
 kernel void setup_system(read_only image2d_t source,
                          read_only image2d_t target,
                          write_only image2d_t b,
@@ -65,14 +111,82 @@ kernel void setup_system(read_only image2d_t source,
 #ifdef FIX_BROKEN_IMAGE_WRITING
     coord.x = coord.x * 2;
 #endif
-    write_imagef(b, coord, laplacef);
+    write_pixel(b, coord, pixel_from_float4(laplacef));
     if (initialize) {
       // write_imagef(x, coord, 0);
-      write_imagef(x, coord, convert_float4(pixel));
+      write_pixel(x, coord, pixel_from_float4(convert_float4(pixel)));
     }
   }
 }
 
+// Source part of the right hand side of a pixel inside the mask: the
+// Laplacian of the source. setup_system only counts the neighbours where the
+// target is opaque, which the targets from make_rgba are everywhere.
+int4 source_laplace(read_only image2d_t source, int2 coord) {
+  int4 source_m = convert_int4(read_imageui(source, sampler, coord));
+  return 4 * source_m
+         - convert_int4(read_imageui(source, sampler, coord + (int2)( 0,  1)))
+         - convert_int4(read_imageui(source, sampler, coord + (int2)(-1,  0)))
+         - convert_int4(read_imageui(source, sampler, coord + (int2)( 0, -1)))
+         - convert_int4(read_imageui(source, sampler, coord + (int2)( 1,  0)));
+}
+
+// Boundary condition of the neighbour coord + step: its target value if it
+// lies outside the mask
+int4 boundary_term(read_only image2d_t source, read_only image2d_t target,
+                   int2 coord, int2 step, int2 offset) {
+  if (read_imageui(source, sampler, coord + step).w) {
+    return (int4)(0);
+  }
+  return convert_int4(read_imageui(target, sampler, coord + step + offset));
+}
+
+// The part of setup_system that only depends on the source, run once per
+// system: b of the pixels inside the mask without the boundary conditions,
+// and with initialize x starting from the source pixels. update_boundary
+// adds the boundary conditions.
+kernel void setup_guidance(read_only image2d_t source,
+                           write_only image2d_t b,
+                           write_only image2d_t x,
+                           int initialize) {
+  int2 coord = (int2)(get_global_id(0), get_global_id(1));
+  uint4 pixel = read_imageui(source, sampler, coord);
+  if (!pixel.w) return;
+
+  int4 laplace = source_laplace(source, coord);
+  laplace.w = 1;
+#ifdef FIX_BROKEN_IMAGE_WRITING
+  coord.x = coord.x * 2;
+#endif
+  write_pixel(b, coord, pixel_from_float4(convert_float4(laplace)));
+  if (initialize) {
+    write_pixel(x, coord, pixel_from_float4(convert_float4(pixel)));
+  }
+}
+
+// Rewrites b of the listed pixels, those inside the mask next to the
+// boundary, for the target read at offset (ox, oy). The other pixels keep
+// what setup_guidance wrote.
+kernel void update_boundary(read_only image2d_t source,
+                            read_only image2d_t target,
+                            write_only image2d_t b,
+                            global const int2* pixels,
+                            int ox, int oy) {
+  int2 coord = pixels[get_global_id(0)];
+  int2 offset = (int2)(ox, oy);
+
+  int4 laplace = source_laplace(source, coord);
+  laplace += boundary_term(source, target, coord, (int2)( 0,  1), offset);
+  laplace += boundary_term(source, target, coord, (int2)(-1,  0), offset);
+  laplace += boundary_term(source, target, coord, (int2)( 0, -1), offset);
+  laplace += boundary_term(source, target, coord, (int2)( 1,  0), offset);
+  laplace.w = 1;
+#ifdef FIX_BROKEN_IMAGE_WRITING
+  coord.x = coord.x * 2;
+#endif
+  write_pixel(b, coord, pixel_from_float4(convert_float4(laplace)));
+}
+
 float laplace_m(float h) {
   return (8 * h * h + 4) / (3 * h * h);
 }
@@ -83,123 +197,289 @@ float laplace_c(float h) {
   return -(h * h - 1) / (3 * h * h);
 }
 
-kernel void jacobi(read_only image2d_t b,
-                   read_only image2d_t x_in,
-                   write_only image2d_t x_out,
-                   local float4* cache) {
+// Coordinate of the work-item in a launch over a list of active tiles, where
+// work-group i covers tile tiles[i]. Launches over the whole image pass NULL
+// for tiles.
+int2 tile_coord(global const int2* tiles) {
+  if (!tiles) {
+    return (int2)(get_global_id(0), get_global_id(1));
+  }
+  return tiles[get_group_id(0)] * (int2)(get_local_size(0), get_local_size(1))
+         + (int2)(get_local_id(0), get_local_id(1));
+}
+
+// Appends the index of every tile with at least one pixel inside the mask of
+// b to tiles. One work-group covers one tile.
+kernel void collect_active_tiles(read_only image2d_t b,
+                                 local int* active,
+                                 global int* count,
+                                 global int2* tiles) {
   int2 coord = (int2)(get_global_id(0), get_global_id(1));
+  int2 image_dim = get_image_dim(b);
+  bool first = get_local_id(0) == 0 && get_local_id(1) == 0;
+  if (first) {
+    *active = 0;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (coord.x < image_dim.x && coord.y < image_dim.y &&
+      read_pixel(b, sampler, coord).SPACING != 0.0f) {
+    *active = 1;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (first && *active) {
+    tiles[atomic_inc(count)] = (int2)(get_group_id(0), get_group_id(1));
+  }
+}
 
-  float4 sigma = read_imagef(b, sampler, coord);
-  float4 sigma_tmp = sigma;
-  float h = sigma_tmp.w;
-  float c = laplace_c(h ? h : 1);
-  float e = laplace_e(h ? h : 1);
-  float m = laplace_m(h ? h : 1);
-  // printf("%f %f %f\n", h, e, m);
-
-  // local bool do_work;
-  // do_work = false;
-  // barrier(CLK_LOCAL_MEM_FENCE);
-  // if (is_laplace) do_work = true;
-  // barrier(CLK_LOCAL_MEM_FENCE);
-  // if (!do_work) {
-  //   printf("quitting...\n");
-  //   return;
-  // }
+pixel_t neighbours(local const pixel_t* cache, int i, int w, float e, float c) {
+  return e * (cache[i + w] + cache[i - 1] + cache[i - w] + cache[i + 1]) +
+         c * (cache[i + w + 1] + cache[i + w - 1] +
+              cache[i - w + 1] + cache[i - w - 1]);
+}
 
+// Temporally blocked Jacobi. x is cached with a halo as deep as the number of
+// sweeps (plus one if the residual is written as well) and every sweep
+// updates a region one pixel smaller than the one before, so the neighbours
+// each sweep reads are always up to date and the tile itself is exact after
+// the last one. Both caches are (tile + 2 * halo)^2 pixels; pixels outside the
+// image get the value of the clamped pixel, like the sampler would return.
+kernel void jacobi(read_only image2d_t b,
+                   read_only image2d_t x_in,
+                   write_only image2d_t x_out,
+                   write_only image2d_t res,
+                   int sweeps,
+                   int write_residual,
+                   local pixel_t* cache,
+                   local pixel_t* updated,
+                   global const int2* tiles) {
+  int2 tile = (int2)(get_local_size(0), get_local_size(1));
+  int2 lid = (int2)(get_local_id(0), get_local_id(1));
+  int2 origin = tile_coord(tiles) - lid;
+  int2 coord = origin + lid;
   int2 image_dim = get_image_dim(x_in);
+  int local_index = lid.y * tile.x + lid.x;
+  int local_count = tile.x * tile.y;
+
+  int halo = sweeps + write_residual;
+  int cw = tile.x + 2 * halo;
+  for (int i = local_index; i < cw * (tile.y + 2 * halo); i += local_count) {
+    cache[i] = read_pixel(x_in, sampler,
+                          origin + (int2)(i % cw, i / cw) - (int2)(halo));
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
 
-  int2 lc = (int2)(get_local_id(0), get_local_id(1)) + (int2)(1);
-  int lw = get_local_size(0) + 2;
-
-  // Fill Cache
-  cache[lw * lc.y + lc.x] = read_imagef(x_in, sampler, coord);
-  if (lc.x == 1) {
-    cache[lw*lc.y+lc.x-1] = read_imagef(x_in, sampler, coord + (int2)(-1, 0));
-    if (lc.y == 1) {
-      cache[lw*(lc.y-1)+lc.x-1] =
-                             read_imagef(x_in, sampler, coord + (int2)(-1, -1));
-    } else if (lc.y == lw - 2) {
-      cache[lw*(lc.y+1)+lc.x-1] =
-                             read_imagef(x_in, sampler, coord + (int2)(-1, 1));
-    }
-  } else if (lc.x == lw - 2) {
-    cache[lw*lc.y+lc.x+1] = read_imagef(x_in, sampler, coord + (int2)( 1, 0));
-    if (lc.y == lw - 2) {
-      cache[lw*(lc.y+1)+lc.x+1] =
-                             read_imagef(x_in, sampler, coord + (int2)(1, 1));
-    } else if (lc.y == 1) {
-      cache[lw*(lc.y-1)+lc.x+1] =
-                             read_imagef(x_in, sampler, coord + (int2)(1, -1));
+  for (int sweep = 1; sweep <= sweeps; ++sweep) {
+    int ring = halo - sweep;
+    int rw = tile.x + 2 * ring;
+    for (int i = local_index; i < rw * (tile.y + 2 * ring); i += local_count) {
+      int2 p = (int2)(i % rw, i / rw) - (int2)(ring);
+      int2 pixel = clamp(origin + p, (int2)(0), image_dim - (int2)(1));
+      int c = cw * (pixel.y - origin.y + halo) + pixel.x - origin.x + halo;
+      pixel_t sigma = read_pixel(b, sampler, pixel);
+      float h = sigma.SPACING;
+      pixel_t value = cache[c];
+      if (h != 0.0f) {
+        value = (sigma - neighbours(cache, c, cw, laplace_e(h),
+                                    laplace_c(h))) / laplace_m(h);
+        value.SPACING = 255.0f;
+      }
+      updated[cw * (p.y + halo) + p.x + halo] = value;
     }
-  }
-  if (lc.y == 1) {
-    cache[lw*(lc.y-1)+lc.x] = read_imagef(x_in, sampler, coord + (int2)(0, -1));
-  } else if (lc.y == lw - 2) {
-    cache[lw*(lc.y+1)+lc.x] = read_imagef(x_in, sampler, coord + (int2)(0,  1));
+    barrier(CLK_LOCAL_MEM_FENCE);
+    local pixel_t* tmp = cache;
+    cache = updated;
+    updated = tmp;
   }
 
-  barrier(CLK_LOCAL_MEM_FENCE);  // Cache has been written at this point
+  if (coord.x >= image_dim.x || coord.y >= image_dim.y) return;
+  pixel_t sigma = read_pixel(b, sampler, coord);
+  float h = sigma.SPACING;
+  if (h == 0.0f) return;
+
+  int c = cw * (lid.y + halo) + lid.x + halo;
+  pixel_t x = cache[c];
+  sigma -= neighbours(cache, c, cw, laplace_e(h), laplace_c(h));
+  sigma -= laplace_m(h) * x;
+  sigma.SPACING = h;
+#ifdef FIX_BROKEN_IMAGE_WRITING
+  coord.x = coord.x * 2;
+#endif
+  write_pixel(x_out, coord, x);
+  if (write_residual) {
+    write_pixel(res, coord, sigma);
+  }
+}
 
-  for (int i = 0; i < 10; ++i) {
-    sigma_tmp -= e * cache[lw*(lc.y+1)+lc.x];
-    sigma_tmp -= e * cache[lw*lc.y+lc.x-1];
-    sigma_tmp -= e * cache[lw*(lc.y-1)+lc.x];
-    sigma_tmp -= e * cache[lw*lc.y+lc.x+1];
-    sigma_tmp -= c * cache[lw*(lc.y+1)+lc.x+1];
-    sigma_tmp -= c * cache[lw*(lc.y+1)+lc.x-1];
-    sigma_tmp -= c * cache[lw*(lc.y-1)+lc.x+1];
-    sigma_tmp -= c * cache[lw*(lc.y-1)+lc.x-1];
-    sigma_tmp /= m;
+// Colour of a pixel in a multicolour Gauss-Seidel sweep with 2 or 4 colours
+int pixel_colour(int2 coord, int colours) {
+  return colours == 2 ? (coord.x + coord.y) & 1
+                      : (coord.x & 1) | ((coord.y & 1) << 1);
+}
 
-    cache[lw*lc.y+lc.x] = h ? sigma_tmp : sigma;
-    sigma_tmp = sigma;
+// One colour of a multicolour Gauss-Seidel sweep. On the finest grid the
+// stencil has no diagonal entries (laplace_c(1) == 0) and two colours
+// (red-black) decouple the unknowns, coarser grids use the full nine point
+// stencil and need four colours. One work-item per pixel: the pixels of
+// colour are updated from their neighbours, which all have other colours, so
+// no pixel is read and written in the same launch. In place that is all,
+// otherwise the other pixels inside the mask are copied from x_in so that
+// x_out holds the whole sweep.
+kernel void gauss_seidel(read_only image2d_t b,
+                         SOLUTION_ARGS,
+                         int colours,
+                         int colour,
+                         global const int2* tiles) {
+  int2 coord = tile_coord(tiles);
+  int2 image_dim = solution_dim();
+  if (coord.x >= image_dim.x || coord.y >= image_dim.y) return;
+
+  pixel_t sigma = read_pixel(b, sampler, coord);
+  float h = sigma.SPACING;
+  if (h == 0.0f) return;
 
-    barrier(CLK_LOCAL_MEM_FENCE);  // Cache has been updated here
+  if (pixel_colour(coord, colours) != colour) {
+#ifndef READ_WRITE_IMAGES
+    pixel_t value = read_solution(coord);
+#ifdef FIX_BROKEN_IMAGE_WRITING
+    coord.x = coord.x * 2;
+#endif
+    write_solution(coord, value);
+#endif
+    return;
   }
 
-  if (h && coord.x < image_dim.x && coord.y < image_dim.y) {
-    cache[lw*lc.y+lc.x].w = 255.0f;
+  float c = laplace_c(h);
+  float e = laplace_e(h);
+  float m = laplace_m(h);
+
+  sigma -= e * read_solution(coord + (int2)( 0,  1));
+  sigma -= e * read_solution(coord + (int2)(-1,  0));
+  sigma -= e * read_solution(coord + (int2)( 0, -1));
+  sigma -= e * read_solution(coord + (int2)( 1,  0));
+  if (c != 0.0f) {
+    sigma -= c * read_solution(coord + (int2)( 1,  1));
+    sigma -= c * read_solution(coord + (int2)(-1,  1));
+    sigma -= c * read_solution(coord + (int2)( 1, -1));
+    sigma -= c * read_solution(coord + (int2)(-1, -1));
+  }
+  sigma /= m;
+  sigma.SPACING = 255.0f;
 #ifdef FIX_BROKEN_IMAGE_WRITING
-    write_imagef(x_out, coord * (int2)(2, 1), cache[lw*lc.y+lc.x]);
+  coord.x = coord.x * 2;
+#endif
+  write_solution(coord, sigma);
+}
+
+// The last colour of a Gauss-Seidel sweep, which also writes the residual of
+// the whole sweep to res, like jacobi does with write_residual. The tile is
+// cached with a halo of two pixels and the pixels of colour are updated in
+// the tile and the ring of one pixel around it, which is what the residual of
+// the tile reads. Both caches are (tile + 4)^2 pixels. In place the old values
+// of the pixels of colour may already have been overwritten by other
+// work-groups, but the update does not read them.
+kernel void gauss_seidel_residual(read_only image2d_t b,
+                                  SOLUTION_ARGS,
+                                  write_only image2d_t res,
+                                  int colours,
+                                  int colour,
+                                  local pixel_t* cache,
+                                  local pixel_t* updated,
+                                  global const int2* tiles) {
+  int2 tile = (int2)(get_local_size(0), get_local_size(1));
+  int2 lid = (int2)(get_local_id(0), get_local_id(1));
+  int2 origin = tile_coord(tiles) - lid;
+  int2 coord = origin + lid;
+  int2 image_dim = solution_dim();
+  int local_index = lid.y * tile.x + lid.x;
+  int local_count = tile.x * tile.y;
+
+  int cw = tile.x + 4;
+  for (int i = local_index; i < cw * (tile.y + 4); i += local_count) {
+    cache[i] = read_solution(origin + (int2)(i % cw, i / cw) - (int2)(2));
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  int rw = tile.x + 2;
+  for (int i = local_index; i < rw * (tile.y + 2); i += local_count) {
+    int2 p = (int2)(i % rw, i / rw) - (int2)(1);
+    int2 pixel = clamp(origin + p, (int2)(0), image_dim - (int2)(1));
+    int c = cw * (pixel.y - origin.y + 2) + pixel.x - origin.x + 2;
+    pixel_t sigma = read_pixel(b, sampler, pixel);
+    float h = sigma.SPACING;
+    pixel_t value = cache[c];
+    if (h != 0.0f && pixel_colour(pixel, colours) == colour) {
+      value = (sigma - neighbours(cache, c, cw, laplace_e(h),
+                                  laplace_c(h))) / laplace_m(h);
+      value.SPACING = 255.0f;
+    }
+    updated[cw * (p.y + 2) + p.x + 2] = value;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (coord.x >= image_dim.x || coord.y >= image_dim.y) return;
+  pixel_t sigma = read_pixel(b, sampler, coord);
+  float h = sigma.SPACING;
+  if (h == 0.0f) return;
+
+  int c = cw * (lid.y + 2) + lid.x + 2;
+  pixel_t value = updated[c];
+  sigma -= neighbours(updated, c, cw, laplace_e(h), laplace_c(h));
+  sigma -= laplace_m(h) * value;
+  sigma.SPACING = h;
+#ifdef READ_WRITE_IMAGES
+  // In place the other colours are already there, and other work-groups are
+  // reading them
+  bool write_value = pixel_colour(coord, colours) == colour;
 #else
-    write_imagef(x_out, coord, cache[lw*lc.y+lc.x]);
+  bool write_value = true;
+#endif
+#ifdef FIX_BROKEN_IMAGE_WRITING
+  coord.x = coord.x * 2;
 #endif
+  if (write_value) {
+    write_solution(coord, value);
   }
+  write_pixel(res, coord, sigma);
 }
 
 kernel void calculate_residual(read_only image2d_t b,
                                read_only image2d_t x,
-                               write_only image2d_t res) {
-  int2 coord = (int2)(get_global_id(0), get_global_id(1));
-
-  float4 sigma = read_imagef(b, sampler, coord);
-  float h = sigma.w;
+                               write_only image2d_t res,
+                               global const int2* tiles) {
+  int2 coord = tile_coord(tiles);
+  int2 image_dim = get_image_dim(x);
+  if (coord.x >= image_dim.x || coord.y >= image_dim.y) return;
+
+  pixel_t sigma = read_pixel(b, sampler, coord);
+  float h = sigma.SPACING;
   if (h == 0.0f) return;
 
   float c = laplace_c(h ? h : 1);
   float e = laplace_e(h ? h : 1);
   float m = laplace_m(h ? h : 1);
 
-  sigma -= e * read_imagef(x, sampler, coord + (int2)( 0,  1));
-  sigma -= e * read_imagef(x, sampler, coord + (int2)(-1,  0));
-  sigma -= e * read_imagef(x, sampler, coord + (int2)( 0, -1));
-  sigma -= e * read_imagef(x, sampler, coord + (int2)( 1,  0));
-  sigma -= c * read_imagef(x, sampler, coord + (int2)( 1,  1));
-  sigma -= c * read_imagef(x, sampler, coord + (int2)(-1,  1));
-  sigma -= c * read_imagef(x, sampler, coord + (int2)( 1, -1));
-  sigma -= c * read_imagef(x, sampler, coord + (int2)(-1, -1));
-
-  sigma -= m * read_imagef(x, sampler, coord);
-  sigma.w = h;
+  sigma -= e * read_pixel(x, sampler, coord + (int2)( 0,  1));
+  sigma -= e * read_pixel(x, sampler, coord + (int2)(-1,  0));
+  sigma -= e * read_pixel(x, sampler, coord + (int2)( 0, -1));
+  sigma -= e * read_pixel(x, sampler, coord + (int2)( 1,  0));
+  sigma -= c * read_pixel(x, sampler, coord + (int2)( 1,  1));
+  sigma -= c * read_pixel(x, sampler, coord + (int2)(-1,  1));
+  sigma -= c * read_pixel(x, sampler, coord + (int2)( 1, -1));
+  sigma -= c * read_pixel(x, sampler, coord + (int2)(-1, -1));
+
+  sigma -= m * read_pixel(x, sampler, coord);
+  sigma.SPACING = h;
 #ifdef FIX_BROKEN_IMAGE_WRITING
   coord.x = coord.x * 2;
 #endif
-  write_imagef(res, coord, sigma);
+  write_pixel(res, coord, sigma);
 }
 
-kernel void reset_image(write_only image2d_t out) {
-  int2 coord = (int2)(get_global_id(0), get_global_id(1));
+kernel void reset_image(write_only image2d_t out,
+                        global const int2* tiles) {
+  int2 coord = tile_coord(tiles);
+  int2 image_dim = get_image_dim(out);
+  if (coord.x >= image_dim.x || coord.y >= image_dim.y) return;
 #ifdef FIX_BROKEN_IMAGE_WRITING
   coord.x = coord.x * 2;
 #endif
@@ -207,6 +487,16 @@ kernel void reset_image(write_only image2d_t out) {
 }
 
 
+// Copies src to dst, converting between their image formats
+kernel void copy_image(read_only image2d_t src,
+                       write_only image2d_t dst) {
+  int2 coord = (int2)(get_global_id(0), get_global_id(1));
+  float4 value = read_imagef(src, sampler, coord);
+#ifdef FIX_BROKEN_IMAGE_WRITING
+  coord.x = coord.x * 2;
+#endif
+  write_imagef(dst, coord, value);
+}
 
 const sampler_t bilinear_sampler = CLK_NORMALIZED_COORDS_TRUE |
                                    CLK_FILTER_LINEAR |
@@ -215,118 +505,255 @@ const sampler_t nearest_sampler = CLK_NORMALIZED_COORDS_TRUE |
                                   CLK_FILTER_NEAREST |
                                   CLK_ADDRESS_CLAMP_TO_EDGE;
 
-kernel void bilinear_interp(read_only image2d_t source,
-                            write_only image2d_t output) {
-  int2 coord = (int2)(get_global_id(0), get_global_id(1));
-
-#ifdef FIX_BROKEN_IMAGE_WRITING
-  write_imagef(output, coord * (int2)(2, 1),
-#else
-  write_imagef(output, coord,
-#endif
-    read_imagef(source, bilinear_sampler,
-                (convert_float2(coord) + (float2)(0.5f)) /
-                convert_float2(get_image_dim(output))));
-}
-
 kernel void bilinear_restrict(read_only image2d_t source,
-                              write_only image2d_t output) {
+                              write_only image2d_t output,
+                              global const int2* tiles) {
 
-  int2 coord = (int2)(get_global_id(0), get_global_id(1));
+  int2 coord = tile_coord(tiles);
+  if (coord.x >= get_image_width(output) ||
+      coord.y >= get_image_height(output)) return;
 
-  float4 ll = read_imagef(source, bilinear_sampler,
+  pixel_t ll = read_pixel(source, bilinear_sampler,
                            (convert_float2(coord)) /
                            convert_float2(get_image_dim(output)));
-  float4 lr = read_imagef(source, bilinear_sampler,
+  pixel_t lr = read_pixel(source, bilinear_sampler,
                            (convert_float2(coord) + (float2)(1.0f, 0.0f)) /
                            convert_float2(get_image_dim(output)));
-  float4 ul = read_imagef(source, bilinear_sampler,
+  pixel_t ul = read_pixel(source, bilinear_sampler,
                            (convert_float2(coord) + (float2)(0.0f, 1.0f)) /
                            convert_float2(get_image_dim(output)));
-  float4 ur = read_imagef(source, bilinear_sampler,
+  pixel_t ur = read_pixel(source, bilinear_sampler,
                            (convert_float2(coord) + (float2)(0.0f, 1.0f)) /
                            convert_float2(get_image_dim(output)));
-  float4 lln = read_imagef(source, nearest_sampler,
+  pixel_t lln = read_pixel(source, nearest_sampler,
                            (convert_float2(coord)) /
                            convert_float2(get_image_dim(output)));
-  float4 lrn = read_imagef(source, nearest_sampler,
+  pixel_t lrn = read_pixel(source, nearest_sampler,
                            (convert_float2(coord) + (float2)(1.0f, 0.0f)) /
                            convert_float2(get_image_dim(output)));
-  float4 uln = read_imagef(source, nearest_sampler,
+  pixel_t uln = read_pixel(source, nearest_sampler,
                            (convert_float2(coord) + (float2)(0.0f, 1.0f)) /
                            convert_float2(get_image_dim(output)));
-  float4 urn = read_imagef(source, nearest_sampler,
+  pixel_t urn = read_pixel(source, nearest_sampler,
                            (convert_float2(coord) + (float2)(0.0f, 1.0f)) /
                            convert_float2(get_image_dim(output)));
 
-  float4 result = (ll + lr + ul + ur) / 2.5f;
+  pixel_t result = (ll + lr + ul + ur) / 2.5f;
   // result.w = ll.w && lr.w && ul.w && ur.w;
-  result.w = fmax(fmax(fmax(lln.w, lrn.w), uln.w), urn.w);
-  if (result.w) result.w += 1.0f;
+  result.SPACING = fmax(fmax(fmax(lln.SPACING, lrn.SPACING), uln.SPACING),
+                        urn.SPACING);
+  if (result.SPACING) result.SPACING += 1.0f;
   // printf("%f %f %d\n", res1, result.w, res1 == result.w);
 
 #ifdef FIX_BROKEN_IMAGE_WRITING
-  write_imagef(output, coord * (int2)(2, 1),
-#else
-  write_imagef(output, coord,
+  coord.x = coord.x * 2;
 #endif
-               result);
+  write_pixel(output, coord, result);
 }
 
-kernel void reduce(read_only image2d_t buffer,
-                   const long length,
-                   local float* scratch,
-                   global float* result) {
-  int global_index = get_global_id(0);
-  int2 size = get_image_dim(buffer);
-  float accumulator = 0.0f;
-
-  // Loop sequentially over chunks of input vector
-  while (global_index < length) {
-    float4 element = read_imagef(buffer, sampler,
-                                         (int2)(global_index % size.x,
-                                                global_index / size.x));
-    accumulator += dot(element * element, (float4)(1.0f, 1.0f, 1.0f, 0.0f));
-    global_index += get_global_size(0);
+void reduce_local_norms(local float4* sums, local float4* maxima,
+                        int local_index, int local_count) {
+  for (int offset = local_count / 2; offset > 0; offset = offset / 2) {
+    if (local_index < offset) {
+      sums[local_index] += sums[local_index + offset];
+      maxima[local_index] = fmax(maxima[local_index],
+                                 maxima[local_index + offset]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
   }
+}
 
-  // Perform parallel reduction
-  int local_index = get_local_id(0);
-  scratch[local_index] = accumulator;
+// First stage of the residual norm reduction: every work-group reduces its
+// tile of the image to the per channel sum of squares and maximum absolute
+// value, stored as a pair at partial[2 * group].
+kernel void reduce_norms(read_only image2d_t image,
+                         local float4* sums,
+                         local float4* maxima,
+                         global float4* partial) {
+  int2 coord = (int2)(get_global_id(0), get_global_id(1));
+  int2 image_dim = get_image_dim(image);
+  float4 value = 0.0f;
+  if (coord.x < image_dim.x && coord.y < image_dim.y) {
+    value = colour_float4(read_pixel(image, sampler, coord));
+  }
+  int local_index = get_local_id(1) * get_local_size(0) + get_local_id(0);
+  sums[local_index] = value * value;
+  maxima[local_index] = fabs(value);
   barrier(CLK_LOCAL_MEM_FENCE);
 
-  for(int offset = get_local_size(0) / 2;
-      offset > 0;
-      offset = offset / 2) {
-    if (local_index < offset) {
-      float other = scratch[local_index + offset];
-      float mine = scratch[local_index];
-      scratch[local_index] = other + mine;
-    }
-    barrier(CLK_LOCAL_MEM_FENCE);
+  reduce_local_norms(sums, maxima, local_index,
+                     get_local_size(0) * get_local_size(1));
+  if (local_index == 0) {
+    int group = get_group_id(1) * get_num_groups(0) + get_group_id(0);
+    partial[2 * group] = sums[0];
+    partial[2 * group + 1] = maxima[0];
+  }
+}
+
+// First stage of a dot product, like reduce_norms but with the per channel
+// sum and maximum absolute value of lhs * rhs
+kernel void reduce_products(read_only image2d_t lhs,
+                            read_only image2d_t rhs,
+                            local float4* sums,
+                            local float4* maxima,
+                            global float4* partial) {
+  int2 coord = (int2)(get_global_id(0), get_global_id(1));
+  int2 image_dim = get_image_dim(lhs);
+  float4 value = 0.0f;
+  if (coord.x < image_dim.x && coord.y < image_dim.y) {
+    value = colour_float4(read_pixel(lhs, sampler, coord) *
+                          read_pixel(rhs, sampler, coord));
   }
+  int local_index = get_local_id(1) * get_local_size(0) + get_local_id(0);
+  sums[local_index] = value;
+  maxima[local_index] = fabs(value);
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  reduce_local_norms(sums, maxima, local_index,
+                     get_local_size(0) * get_local_size(1));
   if (local_index == 0) {
-    result[get_group_id(0)] = scratch[0];
+    int group = get_group_id(1) * get_num_groups(0) + get_group_id(0);
+    partial[2 * group] = sums[0];
+    partial[2 * group + 1] = maxima[0];
   }
 }
 
-kernel void add_images(read_only image2d_t lhs,
-                       read_only image2d_t rhs,
+// Further stages: reduces count pairs of the previous stage per work-group
+kernel void reduce_norms_partial(global const float4* partial_in,
+                                 const int count,
+                                 local float4* sums,
+                                 local float4* maxima,
+                                 global float4* partial_out) {
+  int index = get_global_id(0);
+  int local_index = get_local_id(0);
+  sums[local_index] = index < count ? partial_in[2 * index] : 0.0f;
+  maxima[local_index] = index < count ? partial_in[2 * index + 1] : 0.0f;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  reduce_local_norms(sums, maxima, local_index, get_local_size(0));
+  if (local_index == 0) {
+    partial_out[2 * get_group_id(0)] = sums[0];
+    partial_out[2 * get_group_id(0) + 1] = maxima[0];
+  }
+}
+
+// Prolongation: adds the coarse grid correction, sampled bilinearly at the
+// centre of each fine pixel, to the solution on the pixels inside the mask
+// of b and zeroes the solution outside.
+kernel void interp_add(read_only image2d_t coarse,
                        read_only image2d_t b,
-                       write_only image2d_t result) {
+                       SOLUTION_ARGS,
+                       global const int2* tiles) {
+  int2 coord = tile_coord(tiles);
+  int2 image_dim = solution_dim();
+  if (coord.x >= image_dim.x || coord.y >= image_dim.y) return;
+
+  pixel_t result_val;
+  if (read_pixel(b, sampler, coord).SPACING == 0.0f) {
+    result_val = 0.0f;
+  } else {
+    pixel_t fine = read_solution(coord);
+    result_val = fine + read_pixel(coarse, bilinear_sampler,
+                                   (convert_float2(coord) + (float2)(0.5f)) /
+                                   convert_float2(image_dim));
+    result_val.SPACING = fine.SPACING;
+  }
+#ifdef FIX_BROKEN_IMAGE_WRITING
+  coord.x = coord.x * 2;
+#endif
+  write_solution(coord, result_val);
+}
+
+// Moves the membrane of set_offset: adds the plane a + b * x + c * y, in
+// pixel coordinates of the finest grid, to the colours of the solution inside
+// the mask of b. Pixels outside the mask keep their value, which x_out needs
+// to replace x_in.
+kernel void add_plane(read_only image2d_t b,
+                      SOLUTION_ARGS,
+                      float4 plane_a,
+                      float4 plane_b,
+                      float4 plane_c,
+                      global const int2* tiles) {
+  int2 coord = tile_coord(tiles);
+  int2 image_dim = solution_dim();
+  if (coord.x >= image_dim.x || coord.y >= image_dim.y) return;
+
+  pixel_t result_val = read_solution(coord);
+  if (read_pixel(b, sampler, coord).SPACING != 0.0f) {
+    float4 plane = plane_a + (float)coord.x * plane_b +
+                   (float)coord.y * plane_c;
+    result_val += pixel_from_float4(colour_float4(plane));
+  }
+#ifdef FIX_BROKEN_IMAGE_WRITING
+  coord.x = coord.x * 2;
+#endif
+  write_solution(coord, result_val);
+}
+
+kernel void apply_laplace(read_only image2d_t b,
+                          read_only image2d_t x,
+                          write_only image2d_t result) {
   int2 coord = (int2)(get_global_id(0), get_global_id(1));
-  float4 result_val;
-  if (read_imagef(b, sampler, coord).w == 0.0f) {
+
+  float h = read_pixel(b, sampler, coord).SPACING;
+  pixel_t sigma = 0.0f;
+  if (h != 0.0f) {
+    float c = laplace_c(h);
+    float e = laplace_e(h);
+    float m = laplace_m(h);
+
+    sigma += e * read_pixel(x, sampler, coord + (int2)( 0,  1));
+    sigma += e * read_pixel(x, sampler, coord + (int2)(-1,  0));
+    sigma += e * read_pixel(x, sampler, coord + (int2)( 0, -1));
+    sigma += e * read_pixel(x, sampler, coord + (int2)( 1,  0));
+    sigma += c * read_pixel(x, sampler, coord + (int2)( 1,  1));
+    sigma += c * read_pixel(x, sampler, coord + (int2)(-1,  1));
+    sigma += c * read_pixel(x, sampler, coord + (int2)( 1, -1));
+    sigma += c * read_pixel(x, sampler, coord + (int2)(-1, -1));
+    sigma += m * read_pixel(x, sampler, coord);
+    sigma.SPACING = h;
+  }
+#ifdef FIX_BROKEN_IMAGE_WRITING
+  coord.x = coord.x * 2;
+#endif
+  write_pixel(result, coord, sigma);
+}
+
+// result = y + scale * alpha * x on the pixels inside the mask of b, the w
+// channel of y is passed through. alpha is read from the device, so that it
+// can be computed there.
+kernel void axpy(read_only image2d_t x,
+                 read_only image2d_t y,
+                 read_only image2d_t b,
+                 global const float4* alpha,
+                 float scale,
+                 write_only image2d_t result) {
+  int2 coord = (int2)(get_global_id(0), get_global_id(1));
+  pixel_t result_val;
+  if (read_pixel(b, sampler, coord).SPACING == 0.0f) {
     result_val = 0.0f;
   } else {
-    result_val = read_imagef(lhs, sampler, coord) +
-                 read_imagef(rhs, sampler, coord);
-    result_val.w = 0.0f;
+    pixel_t y_val = read_pixel(y, sampler, coord);
+    result_val = y_val + pixel_from_float4(scale * alpha[0]) *
+                         read_pixel(x, sampler, coord);
+    result_val.SPACING = y_val.SPACING;
   }
 #ifdef FIX_BROKEN_IMAGE_WRITING
-    write_imagef(result, coord * (int2)(2, 1),
-#else
-    write_imagef(result, coord,
+  coord.x = coord.x * 2;
 #endif
-                 result_val);
+  write_pixel(result, coord, result_val);
+}
+
+// result[0] = (numerator[0] - subtrahend[0]) / denominator[0] per channel,
+// and 0 where the denominator is 0. subtrahend may be NULL. One work-item.
+kernel void quotient(global const float4* numerator,
+                     global const float4* subtrahend,
+                     global const float4* denominator,
+                     global float4* result) {
+  float4 n = numerator[0];
+  if (subtrahend) {
+    n -= subtrahend[0];
+  }
+  float4 d = denominator[0];
+  result[0] = select(n / d, (float4)(0.0f), isequal(d, (float4)(0.0f)));
 }
@@ -0,0 +1,336 @@
+// Kernels of PlanarVCycle. Every field of a grid (b, x, residual) is a buffer
+// with one plane of floats per colour channel, each plane being height rows
+// of pitch floats, and get_global_id(2) selects the plane. The pitch is a
+// multiple of four and the padding stays zero. The grid spacing h
+// lives in a separate mask plane of uchar, h inside the mask of the grid and
+// 0 outside, so the smoothers load only the colour values they work on.
+
+const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |
+                          CLK_FILTER_NEAREST |
+                          CLK_ADDRESS_CLAMP_TO_EDGE;
+
+float laplace_m(float h) {
+  return (8 * h * h + 4) / (3 * h * h);
+}
+float laplace_e(float h) {
+  return -(h * h + 2) / (3 * h * h);
+}
+float laplace_c(float h) {
+  return -(h * h - 1) / (3 * h * h);
+}
+
+// Loads like a sampler with CLK_ADDRESS_CLAMP_TO_EDGE
+float load_clamped(global const float* plane, int2 coord, int2 size,
+                   int pitch) {
+  coord = clamp(coord, (int2)(0), size - (int2)(1));
+  return plane[coord.y * pitch + coord.x];
+}
+
+// Bilinear filtering at pos given in pixels, like CLK_FILTER_LINEAR
+float load_bilinear(global const float* plane, float2 pos, int2 size,
+                    int pitch) {
+  pos -= (float2)(0.5f);
+  float2 base = floor(pos);
+  float2 a = pos - base;
+  int2 i = convert_int2(base);
+  return (1.0f - a.x) * (1.0f - a.y) * load_clamped(plane, i, size, pitch) +
+         a.x * (1.0f - a.y) * load_clamped(plane, i + (int2)(1, 0), size,
+                                           pitch) +
+         (1.0f - a.x) * a.y * load_clamped(plane, i + (int2)(0, 1), size,
+                                           pitch) +
+         a.x * a.y * load_clamped(plane, i + (int2)(1, 1), size, pitch);
+}
+
+// Splits the RGBA system written by setup_system into planes. Row y of the
+// planes is row y + row_offset of the images, and only the rows in
+// [interior.x, interior.y) keep their mask: the others are boundary rows
+// that hold values of a neighbouring strip.
+kernel void split_system(read_only image2d_t b_image,
+                         read_only image2d_t x_image,
+                         global float* b,
+                         global float* x,
+                         global uchar* mask,
+                         int pitch,
+                         int plane_size,
+                         int row_offset,
+                         int2 interior,
+                         int initialize) {
+  int2 coord = (int2)(get_global_id(0), get_global_id(1));
+  int2 image_coord = coord + (int2)(0, row_offset);
+  int i = coord.y * pitch + coord.x;
+
+  float4 b_val = read_imagef(b_image, sampler, image_coord);
+  b[i] = b_val.x;
+  b[i + plane_size] = b_val.y;
+  b[i + 2 * plane_size] = b_val.z;
+  mask[i] = coord.y >= interior.x && coord.y < interior.y ?
+            convert_uchar(b_val.w) : 0;
+  if (initialize) {
+    float4 x_val = read_imagef(x_image, sampler, image_coord);
+    x[i] = x_val.x;
+    x[i + plane_size] = x_val.y;
+    x[i + 2 * plane_size] = x_val.z;
+  }
+}
+
+// Packs planes into an RGBA image for drawing, with 255 in the w channel of
+// the pixels inside the mask for the solution and h for the residual. Row y
+// of the planes goes to row y + row_offset of the image.
+kernel void pack_planes(global const float* planes,
+                        global const uchar* mask,
+                        write_only image2d_t image,
+                        int pitch,
+                        int plane_size,
+                        int row_offset,
+                        int solution) {
+  int2 coord = (int2)(get_global_id(0), get_global_id(1));
+  int i = coord.y * pitch + coord.x;
+  float h = mask[i];
+  float4 value = (float4)(planes[i], planes[i + plane_size],
+                          planes[i + 2 * plane_size],
+                          solution && h != 0.0f ? 255.0f : h);
+  coord.y += row_offset;
+#ifdef FIX_BROKEN_IMAGE_WRITING
+  coord.x = coord.x * 2;
+#endif
+  write_imagef(image, coord, value);
+}
+
+// One colour of a multicolour Gauss-Seidel sweep, see gauss_seidel in
+// hellocl_kernels.cl
+kernel void planar_gauss_seidel(global const float* b,
+                                global float* x,
+                                global const uchar* mask,
+                                int2 size,
+                                int pitch,
+                                int plane_size,
+                                int colours,
+                                int colour) {
+  int2 coord = (int2)(get_global_id(0), get_global_id(1));
+  if (colours == 2) {
+    coord.x = 2 * coord.x + ((coord.y + colour) & 1);
+  } else {
+    coord = 2 * coord + (int2)(colour & 1, colour >> 1);
+  }
+  if (coord.x >= size.x || coord.y >= size.y) return;
+
+  int i = coord.y * pitch + coord.x;
+  float h = mask[i];
+  if (h == 0.0f) return;
+
+  int offset = get_global_id(2) * plane_size;
+  global const float* plane = x + offset;
+  float c = laplace_c(h);
+  float e = laplace_e(h);
+  float m = laplace_m(h);
+
+  float sigma = b[offset + i];
+  sigma -= e * (load_clamped(plane, coord + (int2)( 0,  1), size, pitch) +
+                load_clamped(plane, coord + (int2)(-1,  0), size, pitch) +
+                load_clamped(plane, coord + (int2)( 0, -1), size, pitch) +
+                load_clamped(plane, coord + (int2)( 1,  0), size, pitch));
+  if (c != 0.0f) {
+    sigma -= c * (load_clamped(plane, coord + (int2)( 1,  1), size, pitch) +
+                  load_clamped(plane, coord + (int2)(-1,  1), size, pitch) +
+                  load_clamped(plane, coord + (int2)( 1, -1), size, pitch) +
+                  load_clamped(plane, coord + (int2)(-1, -1), size, pitch));
+  }
+  x[offset + i] = sigma / m;
+}
+
+kernel void planar_residual(global const float* b,
+                            global const float* x,
+                            global float* res,
+                            global const uchar* mask,
+                            int2 size,
+                            int pitch,
+                            int plane_size) {
+  int2 coord = (int2)(get_global_id(0), get_global_id(1));
+  int i = coord.y * pitch + coord.x;
+  float h = mask[i];
+  if (h == 0.0f) return;
+
+  int offset = get_global_id(2) * plane_size;
+  global const float* plane = x + offset;
+  float c = laplace_c(h);
+  float e = laplace_e(h);
+  float m = laplace_m(h);
+
+  float sigma = b[offset + i] - m * plane[i];
+  sigma -= e * (load_clamped(plane, coord + (int2)( 0,  1), size, pitch) +
+                load_clamped(plane, coord + (int2)(-1,  0), size, pitch) +
+                load_clamped(plane, coord + (int2)( 0, -1), size, pitch) +
+                load_clamped(plane, coord + (int2)( 1,  0), size, pitch));
+  sigma -= c * (load_clamped(plane, coord + (int2)( 1,  1), size, pitch) +
+                load_clamped(plane, coord + (int2)(-1,  1), size, pitch) +
+                load_clamped(plane, coord + (int2)( 1, -1), size, pitch) +
+                load_clamped(plane, coord + (int2)(-1, -1), size, pitch));
+  res[offset + i] = sigma;
+}
+
+// Same weights as bilinear_restrict in hellocl_kernels.cl
+kernel void planar_restrict(global const float* fine,
+                            global float* coarse,
+                            int2 fine_size,
+                            int fine_pitch,
+                            int fine_plane_size,
+                            int coarse_pitch,
+                            int coarse_plane_size) {
+  int2 coord = (int2)(get_global_id(0), get_global_id(1));
+  float2 scale = convert_float2(fine_size) /
+                 convert_float2((int2)(get_global_size(0),
+                                       get_global_size(1)));
+  global const float* plane = fine + get_global_id(2) * fine_plane_size;
+  float2 pos = convert_float2(coord);
+
+  float ll = load_bilinear(plane, pos * scale, fine_size, fine_pitch);
+  float lr = load_bilinear(plane, (pos + (float2)(1.0f, 0.0f)) * scale,
+                           fine_size, fine_pitch);
+  float ul = load_bilinear(plane, (pos + (float2)(0.0f, 1.0f)) * scale,
+                           fine_size, fine_pitch);
+  coarse[get_global_id(2) * coarse_plane_size +
+         coord.y * coarse_pitch + coord.x] = (ll + lr + 2.0f * ul) / 2.5f;
+}
+
+// Mask of the next coarser grid, as bilinear_restrict derives it from w
+kernel void planar_restrict_mask(global const uchar* fine,
+                                 global uchar* coarse,
+                                 int2 fine_size,
+                                 int fine_pitch,
+                                 int coarse_pitch) {
+  int2 coord = (int2)(get_global_id(0), get_global_id(1));
+  float2 scale = convert_float2(fine_size) /
+                 convert_float2((int2)(get_global_size(0),
+                                       get_global_size(1)));
+  uchar h = 0;
+  for (int j = 0; j < 3; ++j) {
+    float2 pos = (convert_float2(coord) + (float2)(j == 1, j == 2)) * scale;
+    int2 p = clamp(convert_int2(floor(pos)), (int2)(0),
+                   fine_size - (int2)(1));
+    h = max(h, fine[p.y * fine_pitch + p.x]);
+  }
+  coarse[coord.y * coarse_pitch + coord.x] = h ? h + 1 : 0;
+}
+
+// Prolongation, see interp_add in hellocl_kernels.cl. Pixels outside the
+// mask keep their value: they are zero on the coarse grids, which are reset
+// before each correction, but the boundary rows of a strip hold the values
+// of its neighbour.
+kernel void planar_interp_add(global const float* coarse,
+                              global float* x,
+                              global const uchar* mask,
+                              int2 coarse_size,
+                              int coarse_pitch,
+                              int coarse_plane_size,
+                              int pitch,
+                              int plane_size) {
+  int2 coord = (int2)(get_global_id(0), get_global_id(1));
+  if (mask[coord.y * pitch + coord.x] == 0) return;
+  int i = get_global_id(2) * plane_size + coord.y * pitch + coord.x;
+  float2 scale = convert_float2(coarse_size) /
+                 convert_float2((int2)(get_global_size(0),
+                                       get_global_size(1)));
+  x[i] += load_bilinear(coarse + get_global_id(2) * coarse_plane_size,
+                        (convert_float2(coord) + (float2)(0.5f)) * scale,
+                        coarse_size, coarse_pitch);
+}
+
+// Planes are a multiple of four floats, including the zeroed row padding
+kernel void planar_reset(global float4* buffer) {
+  buffer[get_global_id(0)] = (float4)(0.0f);
+}
+
+// First stage of the residual norms, like reduce_norms in hellocl_kernels.cl:
+// every work-item takes the float4 at offset + its index in each of the
+// three planes, and every work-group leaves the per channel sum of squares
+// and maximum absolute value of its count float4 as a pair at
+// partial[2 * group], for reduce_norms_partial to reduce further.
+kernel void planar_reduce_norms(global const float4* values,
+                                int offset,
+                                int count,
+                                int plane_size,
+                                local float4* sums,
+                                local float4* maxima,
+                                global float4* partial) {
+  int index = get_global_id(0);
+  float4 r = (float4)(0.0f);
+  float4 g = (float4)(0.0f);
+  float4 b = (float4)(0.0f);
+  if (index < count) {
+    r = values[offset + index];
+    g = values[plane_size + offset + index];
+    b = values[2 * plane_size + offset + index];
+  }
+  float4 abs_r = fabs(r);
+  float4 abs_g = fabs(g);
+  float4 abs_b = fabs(b);
+  int local_index = get_local_id(0);
+  sums[local_index] = (float4)(dot(r, r), dot(g, g), dot(b, b), 0.0f);
+  maxima[local_index] = (float4)(
+      fmax(fmax(abs_r.x, abs_r.y), fmax(abs_r.z, abs_r.w)),
+      fmax(fmax(abs_g.x, abs_g.y), fmax(abs_g.z, abs_g.w)),
+      fmax(fmax(abs_b.x, abs_b.y), fmax(abs_b.z, abs_b.w)),
+      0.0f);
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (int stride = get_local_size(0) / 2; stride > 0; stride = stride / 2) {
+    if (local_index < stride) {
+      sums[local_index] += sums[local_index + stride];
+      maxima[local_index] = fmax(maxima[local_index],
+                                 maxima[local_index + stride]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+  if (local_index == 0) {
+    partial[2 * get_group_id(0)] = sums[0];
+    partial[2 * get_group_id(0) + 1] = maxima[0];
+  }
+}
+
+// Source part of the right hand side of a pixel, see hellocl_kernels.cl
+int4 source_laplace(read_only image2d_t source, int2 coord) {
+  int4 source_m = convert_int4(read_imageui(source, sampler, coord));
+  return 4 * source_m
+         - convert_int4(read_imageui(source, sampler, coord + (int2)( 0,  1)))
+         - convert_int4(read_imageui(source, sampler, coord + (int2)(-1,  0)))
+         - convert_int4(read_imageui(source, sampler, coord + (int2)( 0, -1)))
+         - convert_int4(read_imageui(source, sampler, coord + (int2)( 1,  0)));
+}
+
+// Boundary condition of the neighbour coord + step, see hellocl_kernels.cl
+int4 boundary_term(read_only image2d_t source, read_only image2d_t target,
+                   int2 coord, int2 step, int2 offset) {
+  if (read_imageui(source, sampler, coord + step).w) {
+    return (int4)(0);
+  }
+  return convert_int4(read_imageui(target, sampler, coord + step + offset));
+}
+
+// Rewrites b of the listed pixels, those inside the mask next to the
+// boundary, for the target read at offset, like update_boundary in
+// hellocl_kernels.cl but straight into the planes. The pixels are given in
+// domain coordinates, row y of the domain is row y - row_offset of the
+// planes, and pixels outside the rows rows of the planes are skipped.
+kernel void planar_update_boundary(read_only image2d_t source,
+                                   read_only image2d_t target,
+                                   global float* b,
+                                   global const int2* pixels,
+                                   int2 offset,
+                                   int pitch,
+                                   int plane_size,
+                                   int row_offset,
+                                   int rows) {
+  int2 coord = pixels[get_global_id(0)];
+  int row = coord.y - row_offset;
+  if (row < 0 || row >= rows) return;
+
+  int4 laplace = source_laplace(source, coord);
+  laplace += boundary_term(source, target, coord, (int2)( 0,  1), offset);
+  laplace += boundary_term(source, target, coord, (int2)(-1,  0), offset);
+  laplace += boundary_term(source, target, coord, (int2)( 0, -1), offset);
+  laplace += boundary_term(source, target, coord, (int2)( 1,  0), offset);
+  int i = row * pitch + coord.x;
+  b[i] = convert_float(laplace.x);
+  b[i + plane_size] = convert_float(laplace.y);
+  b[i + 2 * plane_size] = convert_float(laplace.z);
+}
@@ -0,0 +1,266 @@
+#include "opencl.h"
+#include "multi_device.h"
+
+#include <algorithm>
+#include <iostream>
+
+namespace pv {
+
+MultiDeviceVCycle::MultiDeviceVCycle() :
+    queues_(),
+    strips_(),
+    strip_count_(0),
+    coarse_(),
+    program_(),
+    planar_program_(),
+    setup_system(),
+    reset_image(),
+    rim_pixels_(),
+    b_image_(),
+    x_image_(),
+    residual_image_() {
+}
+
+void MultiDeviceVCycle::init(cl::Context context, cl::CommandQueue queue) {
+  init(context, std::vector<cl::CommandQueue>(1, queue));
+}
+
+void MultiDeviceVCycle::init(cl::Context context,
+                             std::vector<cl::CommandQueue> queues) {
+  Solver::init(context, queues[0]);
+  queues_ = queues;
+
+  program_ = pv::load_program(context_, "hellocl_kernels");
+  planar_program_ = pv::load_program(context_, "planar_kernels");
+  strips_.clear();
+  for (size_t i = 0; i < queues_.size(); ++i) {
+    strips_.push_back(std::unique_ptr<PlanarVCycle>(new PlanarVCycle));
+    strips_.back()->init(context_, queues_[i], program_, planar_program_);
+  }
+  coarse_.init(context_, queues_[0], program_, planar_program_);
+
+  try {
+    setup_system = cl::Kernel(program_, "setup_system", NULL);
+    reset_image = cl::Kernel(program_, "reset_image", NULL);
+  } catch (cl::Error error) {
+    std::cerr << "ERROR: "
+              << error.what()
+              << "(" << error.err() << ")"
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+void MultiDeviceVCycle::set_source(cv::Mat source, cv::Mat mask) {
+  Solver::set_source(source, mask);
+
+  cl::Image2D* images[] = { &b_image_, &x_image_, &residual_image_ };
+  for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); ++i) {
+    *images[i] = cl::Image2D(context_, CL_MEM_READ_WRITE,
+                             cl::ImageFormat(CL_RGBA, CL_FLOAT),
+                             size_t(source_.cols), size_t(source_.rows));
+    launch_reset_image(*images[i]);
+  }
+  rim_pixels_ = create_rim_buffer();
+  queue_.finish();
+
+  int rows = source_.rows;
+  strip_count_ = std::min(strips_.size(), size_t(rows));
+  int count = int(strip_count_);
+  for (int i = 0; i < count; ++i) {
+    int begin = rows * i / count;
+    int end = rows * (i + 1) / count;
+    int first = begin > 0 ? begin - 1 : 0;
+    int last = end < rows ? end + 1 : rows;
+    PlanarVCycle::Strip strip = {
+      first, last - first,
+      begin - first, end - first,
+      begin - first, end - first
+    };
+    strips_[size_t(i)]->set_strip(source_.cols, strip, false);
+  }
+  PlanarVCycle::Strip whole = { 0, rows, 0, rows, 0, rows };
+  coarse_.set_strip(source_.cols, whole, true);
+}
+
+void MultiDeviceVCycle::set_target(cv::Mat target) {
+  Solver::set_target(target);
+  setup_new_system(true);
+}
+
+void MultiDeviceVCycle::next_frame(cv::Mat target) {
+  Solver::set_target(target);
+  setup_new_system(false);
+}
+
+void MultiDeviceVCycle::set_offset(int off_x, int off_y) {
+  Solver::set_offset(off_x, off_y);
+  setup_new_system(false);
+}
+
+void MultiDeviceVCycle::setup_new_system(bool initialize) {
+  if (!initialize) {
+    cl_int2 offset = {{pos_x_ + domain_x_, pos_y_ + domain_y_}};
+    for (size_t i = 0; i < strip_count_; ++i) {
+      strips_[i]->launch_update_boundary(cl_source_, cl_target_, rim_pixels_,
+                                         rim_.size(), offset);
+      strips_[i]->queue_.flush();
+    }
+    finish_all();
+    return;
+  }
+  setup_system.setArg<cl::Image2D>(0, cl_source_);
+  setup_system.setArg<cl::Image2D>(1, cl_target_);
+  setup_system.setArg<cl::Image2D>(2, b_image_);
+  setup_system.setArg<cl::Image2D>(3, x_image_);
+  setup_system.setArg<cl_int>(4, pos_x_ + domain_x_);
+  setup_system.setArg<cl_int>(5, pos_y_ + domain_y_);
+  setup_system.setArg<cl_int>(6, initialize);
+  queue_.enqueueNDRangeKernel(
+    setup_system,
+    cl::NullRange,
+    cl::NDRange(cl_source_.getImageInfo<CL_IMAGE_WIDTH>(),
+                cl_source_.getImageInfo<CL_IMAGE_HEIGHT>()),
+    cl::NullRange
+  );
+  // The strips read the system on their own queues
+  queue_.finish();
+  for (size_t i = 0; i < strip_count_; ++i) {
+    strips_[i]->split(b_image_, x_image_, initialize);
+  }
+  // Only the masks of coarse_ are used, x and b come from the strips
+  coarse_.split(b_image_, x_image_, initialize);
+  finish_all();
+}
+
+void MultiDeviceVCycle::start_calculation_async(double number_iterations) {
+  for (int i = 0; i < int(number_iterations); ++i) {
+    smooth_strips(false);
+    coarse_grid_correction();
+    smooth_strips(true);
+  }
+}
+
+void MultiDeviceVCycle::smooth_strips(bool reverse) {
+  for (size_t s = 0; s < strip_count_; ++s) {
+    strips_[s]->smooth(0, reverse);
+    strips_[s]->queue_.flush();
+  }
+  finish_all();
+  // The residual of the rows next to the boundary rows changes with them
+  exchange_boundary_rows();
+  for (size_t s = 0; s < strip_count_; ++s) {
+    strips_[s]->launch_residual(0);
+    strips_[s]->queue_.flush();
+  }
+  finish_all();
+}
+
+void MultiDeviceVCycle::exchange_boundary_rows() {
+  for (size_t s = 0; s + 1 < strip_count_; ++s) {
+    PlanarVCycle& upper = *strips_[s];
+    PlanarVCycle& lower = *strips_[s + 1];
+    const PlanarVCycle::Strip& a = upper.strip_;
+    const PlanarVCycle::Strip& b = lower.strip_;
+    if (a.interior_end < a.rows) {
+      int row = a.first_row + a.rows - 1;
+      copy_rows(lower, lower.x_stack[0], row - b.first_row,
+                upper, upper.x_stack[0], a.rows - 1, 1);
+    }
+    if (b.interior_begin > 0) {
+      copy_rows(upper, upper.x_stack[0], b.first_row - a.first_row,
+                lower, lower.x_stack[0], 0, 1);
+    }
+  }
+}
+
+void MultiDeviceVCycle::coarse_grid_correction() {
+  if (coarse_.size_stack.size() == 1) {
+    return;
+  }
+  for (size_t s = 0; s < strip_count_; ++s) {
+    PlanarVCycle& strip = *strips_[s];
+    const PlanarVCycle::Strip& rows = strip.strip_;
+    int row = rows.first_row + rows.own_begin;
+    int count = rows.own_end - rows.own_begin;
+    copy_rows(strip, strip.x_stack[0], rows.own_begin,
+              coarse_, coarse_.x_stack[0], row, count);
+    copy_rows(strip, strip.residual_stack[0], rows.own_begin,
+              coarse_, coarse_.residual_stack[0], row, count);
+  }
+  coarse_.coarse_grid_correction(0);
+  coarse_.queue_.finish();
+  // Including the boundary rows, which are the own rows of the neighbours
+  for (size_t s = 0; s < strip_count_; ++s) {
+    PlanarVCycle& strip = *strips_[s];
+    copy_rows(coarse_, coarse_.x_stack[0], strip.strip_.first_row,
+              strip, strip.x_stack[0], 0, strip.strip_.rows);
+    strip.queue_.flush();
+  }
+}
+
+void MultiDeviceVCycle::copy_rows(PlanarVCycle& from,
+                                  const cl::Buffer& from_planes,
+                                  int from_row, PlanarVCycle& to,
+                                  const cl::Buffer& to_planes, int to_row,
+                                  int count) {
+  // All grids of the domain width have the same pitch
+  size_t pitch = size_t(from.size_stack[0].pitch);
+  for (size_t c = 0; c < size_t(PlanarVCycle::CHANNELS); ++c) {
+    to.queue_.enqueueCopyBuffer(
+      from_planes,
+      to_planes,
+      (c * from.plane_size(0) + size_t(from_row) * pitch) * sizeof(cl_float),
+      (c * to.plane_size(0) + size_t(to_row) * pitch) * sizeof(cl_float),
+      size_t(count) * pitch * sizeof(cl_float)
+    );
+  }
+}
+
+float MultiDeviceVCycle::get_residual_average() {
+  for (size_t s = 0; s < strip_count_; ++s) {
+    strips_[s]->enqueue_residual_sum();
+  }
+  double sum = 0.0;
+  for (size_t s = 0; s < strip_count_; ++s) {
+    sum += strips_[s]->finish_residual_sum();
+  }
+  return float(sum / double(source_.cols * source_.rows));
+}
+
+const cl::Image2D& MultiDeviceVCycle::current_solution() {
+  for (size_t s = 0; s < strip_count_; ++s) {
+    strips_[s]->launch_pack(strips_[s]->x_stack[0], x_image_, true);
+  }
+  finish_all();
+  return x_image_;
+}
+
+const cl::Image2D& MultiDeviceVCycle::current_residual() {
+  for (size_t s = 0; s < strip_count_; ++s) {
+    strips_[s]->launch_pack(strips_[s]->residual_stack[0], residual_image_,
+                            false);
+  }
+  finish_all();
+  return residual_image_;
+}
+
+void MultiDeviceVCycle::finish_all() {
+  for (size_t i = 0; i < queues_.size(); ++i) {
+    queues_[i].finish();
+  }
+}
+
+void MultiDeviceVCycle::launch_reset_image(const cl::Image2D& image) {
+  reset_image.setArg<cl::Image2D>(0, image);
+  reset_image.setArg<cl::Buffer>(1, cl::Buffer());
+  queue_.enqueueNDRangeKernel(
+    reset_image,
+    cl::NullRange,
+    cl::NDRange(image.getImageInfo<CL_IMAGE_WIDTH>(),
+                image.getImageInfo<CL_IMAGE_HEIGHT>()),
+    cl::NullRange
+  );
+}
+
+}
@@ -0,0 +1,80 @@
+#ifndef MULTI_DEVICE_H_
+#define MULTI_DEVICE_H_
+
+#include <memory>
+#include <vector>
+
+#include "planar.h"
+
+namespace pv {
+
+// Splits one solve across several command queues, e.g. the devices or NUMA
+// sub-devices from init_cl_devices. The domain is cut into horizontal strips
+// with a PlanarVCycle for each that smooths the finest grid of its rows. A
+// strip reads the row beyond each of its ends as boundary values, which are
+// copied over from the neighbour after every smoothing pass. The coarser
+// grids are small, so a PlanarVCycle of the whole domain on the first queue
+// solves them for all strips.
+class MultiDeviceVCycle : public Solver {
+ public:
+  MultiDeviceVCycle();
+
+  void set_source(cv::Mat source, cv::Mat mask);
+  void set_target(cv::Mat target);
+  void next_frame(cv::Mat target);
+
+  // A single strip on queue
+  void init(cl::Context context, cl::CommandQueue queue);
+  // One strip per queue, all queues of context
+  void init(cl::Context context, std::vector<cl::CommandQueue> queues);
+  void set_offset(int off_x, int off_y);
+
+  // Blocks until all strips are done with number_iterations cycles
+  void start_calculation_async(double number_iterations);
+  float get_residual_average();
+
+  const cl::Image2D& current_solution();
+  const cl::Image2D& current_residual();
+
+ private:
+  // Sets up the whole system with initialize, otherwise the strips only
+  // rewrite the equations of the rim
+  void setup_new_system(bool initialize);
+  // Smoothing pass on the strips, followed by their residual
+  void smooth_strips(bool reverse);
+  void exchange_boundary_rows();
+  // Gathers x and the residual of the strips in coarse_, corrects x there
+  // and scatters it back
+  void coarse_grid_correction();
+  // Copies count rows of the finest planes from_planes of from, starting at
+  // from_row, to to_planes of to from to_row on
+  void copy_rows(PlanarVCycle& from, const cl::Buffer& from_planes,
+                 int from_row, PlanarVCycle& to, const cl::Buffer& to_planes,
+                 int to_row, int count);
+  void finish_all();
+  void launch_reset_image(const cl::Image2D& image);
+
+  std::vector<cl::CommandQueue> queues_;
+  std::vector<std::unique_ptr<PlanarVCycle>> strips_;
+  // Strips in use, fewer than queues for domains with very few rows
+  size_t strip_count_;
+  // Finest grid of the whole domain and all coarser grids, on queues_[0]
+  PlanarVCycle coarse_;
+
+  // hellocl_kernels and planar_kernels, built once for all strips
+  cl::Program program_;
+  cl::Program planar_program_;
+  cl::Kernel setup_system;
+  cl::Kernel reset_image;
+  // cl_int2 coordinates of Solver::rim_
+  cl::Buffer rim_pixels_;
+
+  // RGBA images of the whole domain
+  cl::Image2D b_image_;
+  cl::Image2D x_image_;
+  cl::Image2D residual_image_;
+};
+
+}
+
+#endif  // MULTI_DEVICE_H_
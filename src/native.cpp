@@ -0,0 +1,563 @@
+#include "image.h"
+#include "native.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+namespace pv {
+
+namespace {
+
+// The few vector operations the row loops need, LANES floats wide
+#if defined(__AVX__)
+typedef __m256 vfloat;
+const int LANES = 8;
+inline vfloat vload(const float* p) { return _mm256_loadu_ps(p); }
+inline void vstore(float* p, vfloat v) { _mm256_storeu_ps(p, v); }
+inline vfloat vset(float f) { return _mm256_set1_ps(f); }
+inline vfloat vadd(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+inline vfloat vsub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+inline vfloat vmul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+#elif defined(__SSE__)
+typedef __m128 vfloat;
+const int LANES = 4;
+inline vfloat vload(const float* p) { return _mm_loadu_ps(p); }
+inline void vstore(float* p, vfloat v) { _mm_storeu_ps(p, v); }
+inline vfloat vset(float f) { return _mm_set1_ps(f); }
+inline vfloat vadd(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+inline vfloat vsub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+inline vfloat vmul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+#else
+typedef float vfloat;
+const int LANES = 1;
+inline vfloat vload(const float* p) { return *p; }
+inline void vstore(float* p, vfloat v) { *p = v; }
+inline vfloat vset(float f) { return f; }
+inline vfloat vadd(vfloat a, vfloat b) { return a + b; }
+inline vfloat vsub(vfloat a, vfloat b) { return a - b; }
+inline vfloat vmul(vfloat a, vfloat b) { return a * b; }
+#endif
+
+// Same as in hellocl_kernels.cl
+float laplace_m(float h) {
+  return (8 * h * h + 4) / (3 * h * h);
+}
+float laplace_e(float h) {
+  return -(h * h + 2) / (3 * h * h);
+}
+float laplace_c(float h) {
+  return -(h * h - 1) / (3 * h * h);
+}
+
+int clamp(int value, int low, int high) {
+  return std::min(std::max(value, low), high);
+}
+
+// Loads like a sampler with CLK_ADDRESS_CLAMP_TO_EDGE
+float load_clamped(const float* plane, int x, int y, int width, int height,
+                   int pitch) {
+  return plane[clamp(y, 0, height - 1) * pitch + clamp(x, 0, width - 1)];
+}
+
+// Bilinear filtering at (px, py) given in pixels, like CLK_FILTER_LINEAR
+float load_bilinear(const float* plane, float px, float py, int width,
+                    int height, int pitch) {
+  px -= 0.5f;
+  py -= 0.5f;
+  float bx = std::floor(px);
+  float by = std::floor(py);
+  float ax = px - bx;
+  float ay = py - by;
+  int x = int(bx);
+  int y = int(by);
+  return
+      (1.0f - ax) * (1.0f - ay) *
+          load_clamped(plane, x, y, width, height, pitch) +
+      ax * (1.0f - ay) * load_clamped(plane, x + 1, y, width, height, pitch) +
+      (1.0f - ax) * ay * load_clamped(plane, x, y + 1, width, height, pitch) +
+      ax * ay * load_clamped(plane, x + 1, y + 1, width, height, pitch);
+}
+
+// e times the four direct neighbours plus c times the four diagonal ones
+float neighbours(const float* plane, int x, int y, int width, int height,
+                 int pitch, float e, float c) {
+  float sum = e * (load_clamped(plane, x, y + 1, width, height, pitch) +
+                   load_clamped(plane, x - 1, y, width, height, pitch) +
+                   load_clamped(plane, x, y - 1, width, height, pitch) +
+                   load_clamped(plane, x + 1, y, width, height, pitch));
+  if (c != 0.0f) {
+    sum += c * (load_clamped(plane, x + 1, y + 1, width, height, pitch) +
+                load_clamped(plane, x - 1, y + 1, width, height, pitch) +
+                load_clamped(plane, x + 1, y - 1, width, height, pitch) +
+                load_clamped(plane, x - 1, y - 1, width, height, pitch));
+  }
+  return sum;
+}
+
+// The same for LANES pixels starting at p, none of them on the border
+vfloat neighbours(const float* p, int pitch, vfloat e, vfloat c,
+                  bool diagonals) {
+  vfloat sum = vmul(e, vadd(vadd(vload(p + pitch), vload(p - 1)),
+                            vadd(vload(p - pitch), vload(p + 1))));
+  if (diagonals) {
+    sum = vadd(sum, vmul(c, vadd(vadd(vload(p + pitch + 1),
+                                      vload(p + pitch - 1)),
+                                 vadd(vload(p - pitch + 1),
+                                      vload(p - pitch - 1)))));
+  }
+  return sum;
+}
+
+int aligned_pitch(int width, int alignment) {
+  return (width + alignment - 1) / alignment * alignment;
+}
+
+}
+
+NativeVCycle::NativeVCycle(unsigned threads) :
+    pool_(threads),
+    source_(),
+    target_(),
+    pos_x_(),
+    pos_y_(),
+    domain_x_(),
+    domain_y_(),
+    grids_(),
+    parity_() {
+}
+
+void NativeVCycle::set_source(cv::Mat source, cv::Mat mask) {
+  source_ = pv::make_rgba(source, mask);
+  cv::flip(source_, source_, 0);
+
+  cv::Rect domain = pv::mask_bounding_box(source_, 1);
+  domain_x_ = domain.x;
+  domain_y_ = domain.y;
+  source_ = source_(domain).clone();
+
+  build_multigrid();
+}
+
+void NativeVCycle::set_target(cv::Mat target) {
+  target_ = pv::make_rgba(target);
+  cv::flip(target_, target_, 0);
+  setup_new_system(true);
+}
+
+void NativeVCycle::next_frame(cv::Mat target) {
+  target_ = pv::make_rgba(target);
+  cv::flip(target_, target_, 0);
+  setup_new_system(false);
+}
+
+void NativeVCycle::set_offset(int off_x, int off_y) {
+  pos_x_ = off_x;
+  pos_y_ = off_y;
+  setup_new_system(false);
+}
+
+void NativeVCycle::get_offset(int& off_x, int& off_y) {
+  off_x = pos_x_;
+  off_y = pos_y_;
+}
+
+void NativeVCycle::get_domain(int& x, int& y, int& width, int& height) {
+  x = domain_x_;
+  y = domain_y_;
+  width = source_.cols;
+  height = source_.rows;
+}
+
+void NativeVCycle::build_multigrid() {
+  grids_.clear();
+  int width = source_.cols;
+  int height = source_.rows;
+  for (;;) {
+    Grid grid;
+    grid.width = width;
+    grid.height = height;
+    grid.pitch = aligned_pitch(width, PITCH_ALIGNMENT);
+    grid.h = float(grids_.size() + 1);
+    grid.b.assign(CHANNELS * grid.plane_size(), 0.0f);
+    grid.x.assign(CHANNELS * grid.plane_size(), 0.0f);
+    grid.residual.assign(CHANNELS * grid.plane_size(), 0.0f);
+    grid.inside.assign(grid.plane_size(), 0.0f);
+    grids_.push_back(grid);
+    if (width == 1 || height == 1) {
+      break;
+    }
+    width = (width + 1) / 2;
+    height = (height + 1) / 2;
+  }
+
+  for (int p = 0; p < 2; ++p) {
+    parity_[p].resize(size_t(grids_[0].pitch));
+    for (int x = 0; x < grids_[0].pitch; ++x) {
+      parity_[p][size_t(x)] = (x & 1) == p ? 1.0f : 0.0f;
+    }
+  }
+
+  // The masks only depend on the source
+  Grid& finest = grids_[0];
+  for (int y = 0; y < finest.height; ++y) {
+    const cv::Vec4b* row = source_.ptr<cv::Vec4b>(y);
+    for (int x = 0; x < finest.width; ++x) {
+      finest.inside[size_t(y * finest.pitch + x)] = row[x][3] ? 1.0f : 0.0f;
+    }
+  }
+  for (size_t level = 1; level < grids_.size(); ++level) {
+    Grid& fine = grids_[level - 1];
+    Grid& coarse = grids_[level];
+    for_each_tile(coarse, [&](int x0, int y0, int x1, int y1) {
+      restrict_mask_tile(fine, coarse, x0, y0, x1, y1);
+    });
+  }
+}
+
+void NativeVCycle::setup_new_system(bool initialize) {
+  for_each_tile(grids_[0], [&](int x0, int y0, int x1, int y1) {
+    setup_tile(initialize, x0, y0, x1, y1);
+  });
+}
+
+void NativeVCycle::start_calculation_async(double number_iterations) {
+  for (int i = 0; i < int(number_iterations); ++i) {
+    multigrid_cycle(0);
+  }
+}
+
+void NativeVCycle::multigrid_cycle(size_t level) {
+  if (level == grids_.size() - 1) {
+    return;
+  }
+  Grid& fine = grids_[level];
+  Grid& coarse = grids_[level + 1];
+  smooth(level, false);
+  for_each_tile(fine, [&](int x0, int y0, int x1, int y1) {
+    residual_tile(fine, x0, y0, x1, y1);
+  });
+  for_each_tile(coarse, [&](int x0, int y0, int x1, int y1) {
+    restrict_tile(fine, coarse, x0, y0, x1, y1);
+  });
+  std::fill(coarse.x.begin(), coarse.x.end(), 0.0f);
+  multigrid_cycle(level + 1);
+  for_each_tile(fine, [&](int x0, int y0, int x1, int y1) {
+    interp_add_tile(coarse, fine, x0, y0, x1, y1);
+  });
+  smooth(level, true);
+  if (level == 0) {
+    for_each_tile(fine, [&](int x0, int y0, int x1, int y1) {
+      residual_tile(fine, x0, y0, x1, y1);
+    });
+  }
+}
+
+void NativeVCycle::smooth(size_t level, bool reverse) {
+  Grid& grid = grids_[level];
+  // The finest grid has a five point stencil, coarser grids nine points
+  int colours = level == 0 ? 2 : 4;
+  for (int c = 0; c < colours; ++c) {
+    int colour = reverse ? colours - 1 - c : c;
+    for_each_tile(grid, [&](int x0, int y0, int x1, int y1) {
+      smooth_tile(grid, colours, colour, x0, y0, x1, y1);
+    });
+  }
+}
+
+float NativeVCycle::get_residual_average() {
+  const Grid& grid = grids_[0];
+  int tiles_x = (grid.width + TILE_WIDTH - 1) / TILE_WIDTH;
+  int tiles_y = (grid.height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+  std::vector<double> partial(size_t(tiles_x * tiles_y), 0.0);
+  pool_.parallel_for(tiles_x * tiles_y, [&](int tile) {
+    int x0 = tile % tiles_x * TILE_WIDTH;
+    int y0 = tile / tiles_x * TILE_HEIGHT;
+    int x1 = std::min(x0 + TILE_WIDTH, grid.width);
+    int y1 = std::min(y0 + TILE_HEIGHT, grid.height);
+    double sum = 0.0;
+    for (int channel = 0; channel < CHANNELS; ++channel) {
+      const float* plane = &grid.residual[channel * grid.plane_size()];
+      for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+          float r = plane[y * grid.pitch + x];
+          sum += double(r * r);
+        }
+      }
+    }
+    partial[size_t(tile)] = sum;
+  });
+  double sum = 0.0;
+  for (size_t i = 0; i < partial.size(); ++i) {
+    sum += partial[i];
+  }
+  return float(sum / double(grid.width * grid.height));
+}
+
+int NativeVCycle::solve_until(float tolerance, int max_cycles) {
+  int cycles = 0;
+  while (cycles < max_cycles) {
+    start_calculation_async(1);
+    ++cycles;
+    if (get_residual_average() <= tolerance) {
+      break;
+    }
+  }
+  return cycles;
+}
+
+cv::Mat NativeVCycle::current_solution() const {
+  return pack(grids_[0].x, true);
+}
+
+cv::Mat NativeVCycle::current_residual() const {
+  return pack(grids_[0].residual, false);
+}
+
+cv::Mat NativeVCycle::pack(const std::vector<float>& planes,
+                           bool solution) const {
+  const Grid& grid = grids_[0];
+  cv::Mat result(grid.height, grid.width, CV_32FC4);
+  for (int y = 0; y < grid.height; ++y) {
+    cv::Vec4f* row = result.ptr<cv::Vec4f>(y);
+    for (int x = 0; x < grid.width; ++x) {
+      size_t i = size_t(y * grid.pitch + x);
+      for (int channel = 0; channel < CHANNELS; ++channel) {
+        row[x][channel] = planes[channel * grid.plane_size() + i];
+      }
+      row[x][3] = grid.inside[i] == 0.0f ? 0.0f
+                                         : solution ? 255.0f : grid.h;
+    }
+  }
+  return result;
+}
+
+void NativeVCycle::for_each_tile(
+    const Grid& grid, const std::function<void(int, int, int, int)>& task) {
+  int tiles_x = (grid.width + TILE_WIDTH - 1) / TILE_WIDTH;
+  int tiles_y = (grid.height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+  pool_.parallel_for(tiles_x * tiles_y, [&](int tile) {
+    int x0 = tile % tiles_x * TILE_WIDTH;
+    int y0 = tile / tiles_x * TILE_HEIGHT;
+    task(x0, y0, std::min(x0 + TILE_WIDTH, grid.width),
+         std::min(y0 + TILE_HEIGHT, grid.height));
+  });
+}
+
+// setup_system of hellocl_kernels.cl
+void NativeVCycle::setup_tile(bool initialize, int x0, int y0, int x1,
+                              int y1) {
+  Grid& grid = grids_[0];
+  int ox = pos_x_ + domain_x_;
+  int oy = pos_y_ + domain_y_;
+  const int dx[] = { 0, -1, 0, 1 };
+  const int dy[] = { 1, 0, -1, 0 };
+
+  for (int y = y0; y < y1; ++y) {
+    for (int x = x0; x < x1; ++x) {
+      const cv::Vec4b& pixel = source_.at<cv::Vec4b>(y, x);
+      if (!pixel[3]) {
+        continue;
+      }
+      int laplace[CHANNELS] = { 0, 0, 0 };
+      for (int d = 0; d < 4; ++d) {
+        const cv::Vec4b& source_n = source_.at<cv::Vec4b>(
+            clamp(y + dy[d], 0, source_.rows - 1),
+            clamp(x + dx[d], 0, source_.cols - 1));
+        const cv::Vec4b& target_n = target_.at<cv::Vec4b>(
+            clamp(y + oy + dy[d], 0, target_.rows - 1),
+            clamp(x + ox + dx[d], 0, target_.cols - 1));
+        if (!target_n[3]) {
+          continue;
+        }
+        for (int channel = 0; channel < CHANNELS; ++channel) {
+          if (!source_n[3]) {
+            laplace[channel] += target_n[channel];
+          }
+          laplace[channel] += pixel[channel] - source_n[channel];
+        }
+      }
+      size_t i = size_t(y * grid.pitch + x);
+      for (int channel = 0; channel < CHANNELS; ++channel) {
+        grid.b[channel * grid.plane_size() + i] = float(laplace[channel]);
+        if (initialize) {
+          grid.x[channel * grid.plane_size() + i] = float(pixel[channel]);
+        }
+      }
+    }
+  }
+}
+
+// One colour of gauss_seidel in hellocl_kernels.cl. The vector loop computes
+// all pixels of LANES wide runs of a row and keeps the result only where
+// parity_ selects the colour: a pixel never reads pixels of its own colour,
+// so the pixels of the other colours are written back unchanged. Threads on
+// the neighbouring tiles read those along the tile edges meanwhile, so the
+// pixels within one pixel of the edges take the scalar path, which only
+// writes the colour being smoothed.
+void NativeVCycle::smooth_tile(Grid& grid, int colours, int colour,
+                               int x0, int y0, int x1, int y1) {
+  float e = laplace_e(grid.h);
+  float c = laplace_c(grid.h);
+  float m = laplace_m(grid.h);
+  vfloat ve = vset(e);
+  vfloat vc = vset(c);
+  vfloat inv_m = vset(1.0f / m);
+
+  for (int y = y0; y < y1; ++y) {
+    int parity;
+    if (colours == 2) {
+      parity = (y + colour) & 1;
+    } else if ((y & 1) == colour >> 1) {
+      parity = colour & 1;
+    } else {
+      continue;
+    }
+    bool vector_row = y > y0 && y < y1 - 1;
+    const float* select = &parity_[parity][0];
+    const float* inside = &grid.inside[size_t(y * grid.pitch)];
+
+    for (int channel = 0; channel < CHANNELS; ++channel) {
+      float* x_plane = &grid.x[channel * grid.plane_size()];
+      float* x_row = x_plane + y * grid.pitch;
+      const float* b_row = &grid.b[channel * grid.plane_size() +
+                                   size_t(y * grid.pitch)];
+      int x = x0;
+      while (x < x1) {
+        if (vector_row && x > x0 && x + LANES <= x1 - 1) {
+          vfloat weight = vmul(vload(inside + x), vload(select + x));
+          vfloat old = vload(x_row + x);
+          vfloat value = vmul(vsub(vload(b_row + x),
+                                   neighbours(x_row + x, grid.pitch, ve, vc,
+                                              c != 0.0f)),
+                              inv_m);
+          vstore(x_row + x, vadd(old, vmul(weight, vsub(value, old))));
+          x += LANES;
+        } else {
+          if ((x & 1) == parity && inside[x] != 0.0f) {
+            x_row[x] = (b_row[x] - neighbours(x_plane, x, y, grid.width,
+                                              grid.height, grid.pitch, e,
+                                              c)) / m;
+          }
+          ++x;
+        }
+      }
+    }
+  }
+}
+
+// calculate_residual of hellocl_kernels.cl, 0 outside the mask. The vector
+// loop keeps the same distance from the tile edges as in smooth_tile.
+void NativeVCycle::residual_tile(Grid& grid, int x0, int y0, int x1,
+                                 int y1) {
+  float e = laplace_e(grid.h);
+  float c = laplace_c(grid.h);
+  float m = laplace_m(grid.h);
+  vfloat ve = vset(e);
+  vfloat vc = vset(c);
+  vfloat vm = vset(m);
+
+  for (int y = y0; y < y1; ++y) {
+    bool vector_row = y > y0 && y < y1 - 1;
+    const float* inside = &grid.inside[size_t(y * grid.pitch)];
+    for (int channel = 0; channel < CHANNELS; ++channel) {
+      size_t row = channel * grid.plane_size() + size_t(y * grid.pitch);
+      const float* x_plane = &grid.x[channel * grid.plane_size()];
+      const float* x_row = &grid.x[row];
+      const float* b_row = &grid.b[row];
+      float* r_row = &grid.residual[row];
+      int x = x0;
+      while (x < x1) {
+        if (vector_row && x > x0 && x + LANES <= x1 - 1) {
+          vfloat value = vsub(vsub(vload(b_row + x),
+                                   vmul(vm, vload(x_row + x))),
+                              neighbours(x_row + x, grid.pitch, ve, vc, true));
+          vstore(r_row + x, vmul(vload(inside + x), value));
+          x += LANES;
+        } else {
+          r_row[x] = inside[x] == 0.0f ? 0.0f
+                     : b_row[x] - m * x_row[x] -
+                       neighbours(x_plane, x, y, grid.width, grid.height,
+                                  grid.pitch, e, c);
+          ++x;
+        }
+      }
+    }
+  }
+}
+
+// bilinear_restrict of hellocl_kernels.cl, from the residual of fine into b
+// of coarse
+void NativeVCycle::restrict_tile(const Grid& fine, Grid& coarse,
+                                 int x0, int y0, int x1, int y1) {
+  float scale_x = float(fine.width) / float(coarse.width);
+  float scale_y = float(fine.height) / float(coarse.height);
+  for (int channel = 0; channel < CHANNELS; ++channel) {
+    const float* plane = &fine.residual[channel * fine.plane_size()];
+    float* b = &coarse.b[channel * coarse.plane_size()];
+    for (int y = y0; y < y1; ++y) {
+      for (int x = x0; x < x1; ++x) {
+        float ll = load_bilinear(plane, float(x) * scale_x,
+                                 float(y) * scale_y, fine.width,
+                                 fine.height, fine.pitch);
+        float lr = load_bilinear(plane, float(x + 1) * scale_x,
+                                 float(y) * scale_y, fine.width,
+                                 fine.height, fine.pitch);
+        float ul = load_bilinear(plane, float(x) * scale_x,
+                                 float(y + 1) * scale_y, fine.width,
+                                 fine.height, fine.pitch);
+        b[y * coarse.pitch + x] = (ll + lr + 2.0f * ul) / 2.5f;
+      }
+    }
+  }
+}
+
+void NativeVCycle::restrict_mask_tile(const Grid& fine, Grid& coarse,
+                                      int x0, int y0, int x1, int y1) {
+  float scale_x = float(fine.width) / float(coarse.width);
+  float scale_y = float(fine.height) / float(coarse.height);
+  for (int y = y0; y < y1; ++y) {
+    for (int x = x0; x < x1; ++x) {
+      float inside = 0.0f;
+      for (int j = 0; j < 3; ++j) {
+        int fx = int(std::floor(float(x + (j == 1)) * scale_x));
+        int fy = int(std::floor(float(y + (j == 2)) * scale_y));
+        inside = std::max(inside, load_clamped(&fine.inside[0], fx, fy,
+                                               fine.width, fine.height,
+                                               fine.pitch));
+      }
+      coarse.inside[size_t(y * coarse.pitch + x)] = inside;
+    }
+  }
+}
+
+// interp_add of hellocl_kernels.cl
+void NativeVCycle::interp_add_tile(const Grid& coarse, Grid& fine,
+                                   int x0, int y0, int x1, int y1) {
+  float scale_x = float(coarse.width) / float(fine.width);
+  float scale_y = float(coarse.height) / float(fine.height);
+  for (int channel = 0; channel < CHANNELS; ++channel) {
+    const float* plane = &coarse.x[channel * coarse.plane_size()];
+    float* x_plane = &fine.x[channel * fine.plane_size()];
+    for (int y = y0; y < y1; ++y) {
+      for (int x = x0; x < x1; ++x) {
+        size_t i = size_t(y * fine.pitch + x);
+        if (fine.inside[i] == 0.0f) {
+          x_plane[i] = 0.0f;
+        } else {
+          x_plane[i] += load_bilinear(plane, (float(x) + 0.5f) * scale_x,
+                                      (float(y) + 0.5f) * scale_y,
+                                      coarse.width, coarse.height,
+                                      coarse.pitch);
+        }
+      }
+    }
+  }
+}
+
+}
@@ -0,0 +1,104 @@
+#ifndef NATIVE_H_
+#define NATIVE_H_
+
+#include <cv.h>
+
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace pv {
+
+// The V-cycle of SimpleVCycle in plain C++ for hosts without an OpenCL
+// runtime. The grids are planar like in PlanarVCycle, split into tiles that
+// a ThreadPool works on, and the rows of a tile are vectorized with AVX or
+// SSE where the compiler targets them. Offers the calls of Solver, but the
+// solution is returned as a cv::Mat instead of an OpenCL image.
+class NativeVCycle {
+ public:
+  // threads == 0 uses all hardware threads
+  explicit NativeVCycle(unsigned threads = 0);
+
+  void set_source(cv::Mat source, cv::Mat mask);
+  void set_target(cv::Mat target);
+  // See Solver::next_frame
+  void next_frame(cv::Mat target);
+
+  void set_offset(int off_x, int off_y);
+  void get_offset(int& off_x, int& off_y);
+  // See Solver::get_domain
+  void get_domain(int& x, int& y, int& width, int& height);
+
+  // Runs number_iterations V-cycles, returns when they are done
+  void start_calculation_async(double number_iterations);
+  float get_residual_average();
+  int solve_until(float tolerance, int max_cycles);
+
+  // CV_32FC4 images of the domain laid out like the OpenCL solution and
+  // residual images: RGB, then 255 inside the mask (h for the residual)
+  cv::Mat current_solution() const;
+  cv::Mat current_residual() const;
+
+ private:
+  struct Grid {
+    Grid() : width(), height(), pitch(), h(), b(), x(), residual(),
+             inside() {}
+
+    int width;
+    int height;
+    int pitch;
+    float h;
+    // CHANNELS planes of height rows of pitch floats each
+    std::vector<float> b;
+    std::vector<float> x;
+    std::vector<float> residual;
+    // 1 inside the mask of the grid, 0 outside
+    std::vector<float> inside;
+
+    size_t plane_size() const { return size_t(pitch) * size_t(height); }
+  };
+
+  static const int CHANNELS = 3;
+  static const int TILE_WIDTH = 256;
+  static const int TILE_HEIGHT = 32;
+  static const int PITCH_ALIGNMENT = 8;
+
+  void build_multigrid();
+  void setup_new_system(bool initialize);
+  void multigrid_cycle(size_t level);
+  // Post-smoothing passes the colours in reverse order
+  void smooth(size_t level, bool reverse);
+  // Calls task(x0, y0, x1, y1) for the tiles of grid on the thread pool
+  void for_each_tile(const Grid& grid,
+                     const std::function<void(int, int, int, int)>& task);
+
+  // tile operations
+  void setup_tile(bool initialize, int x0, int y0, int x1, int y1);
+  void smooth_tile(Grid& grid, int colours, int colour,
+                   int x0, int y0, int x1, int y1);
+  void residual_tile(Grid& grid, int x0, int y0, int x1, int y1);
+  void restrict_tile(const Grid& fine, Grid& coarse,
+                     int x0, int y0, int x1, int y1);
+  void restrict_mask_tile(const Grid& fine, Grid& coarse,
+                          int x0, int y0, int x1, int y1);
+  void interp_add_tile(const Grid& coarse, Grid& fine,
+                       int x0, int y0, int x1, int y1);
+  cv::Mat pack(const std::vector<float>& planes, bool solution) const;
+
+  ThreadPool pool_;
+
+  cv::Mat source_;
+  cv::Mat target_;
+  int pos_x_;
+  int pos_y_;
+  int domain_x_;
+  int domain_y_;
+
+  std::vector<Grid> grids_;
+  // parity_[p][x] is 1 where x % 2 == p, selects the pixels of a colour
+  std::vector<float> parity_[2];
+};
+
+}
+
+#endif  // NATIVE_H_
@@ -1,18 +1,19 @@
 #include "opencl.h"
 
-#include <array>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <iterator>
 
-#include <GL/glx.h>
 #include <sys/stat.h>
 #include <highgui.h>
 
 namespace pv {
 
-void init_cl(cl::Context& context_, cl::CommandQueue& queue_, bool with_gl) {
+cl_device_type init_cl(cl::Context& context_, cl::CommandQueue& queue_,
+                       const cl_context_properties* sharing) {
+  cl_device_type type = CL_DEVICE_TYPE_GPU;
   try {
     std::vector<cl::Platform> platforms;
     cl::Platform::get(&platforms);
@@ -20,20 +21,19 @@ void init_cl(cl::Context& context_, cl::CommandQueue& queue_, bool with_gl) {
       std::cerr << "Platform size 0" << std::endl;
       exit(EXIT_FAILURE);
     }
-    cl_context_properties properties[] =
-            { CL_CONTEXT_PLATFORM, cl_context_properties((platforms[0])()),
-              0, 0, 0, 0, 0 };
-
-    if (with_gl) {
-      properties[2] = CL_GLX_DISPLAY_KHR;
-      properties[3] = cl_context_properties(glXGetCurrentDisplay());
-      properties[4] = CL_GL_CONTEXT_KHR;
-      properties[5] = cl_context_properties(glXGetCurrentContext());
+    std::vector<cl_context_properties> properties;
+    properties.push_back(CL_CONTEXT_PLATFORM);
+    properties.push_back(cl_context_properties((platforms[0])()));
+    for (; sharing && sharing[0]; sharing += 2) {
+      properties.push_back(sharing[0]);
+      properties.push_back(sharing[1]);
     }
+    properties.push_back(0);
     try {
-      context_ = cl::Context(CL_DEVICE_TYPE_GPU, properties);
+      context_ = cl::Context(CL_DEVICE_TYPE_GPU, &properties[0]);
     } catch (cl::Error) {
-      context_ = cl::Context(CL_DEVICE_TYPE_CPU, properties);
+      type = CL_DEVICE_TYPE_CPU;
+      context_ = cl::Context(type, &properties[0]);
     }
     std::vector<cl::Device> devices(context_.getInfo<CL_CONTEXT_DEVICES>());
     queue_ = cl::CommandQueue(context_, devices[0], CL_QUEUE_PROFILING_ENABLE);
@@ -45,61 +45,132 @@ void init_cl(cl::Context& context_, cl::CommandQueue& queue_, bool with_gl) {
               << std::endl;
     exit(EXIT_FAILURE);
   }
+  return type;
 }
 
-cl::Program load_program(cl::Context& context_, std::string program_name) {
-  bool load_binary = true;
+void init_cl_devices(cl::Context& context_,
+                     std::vector<cl::CommandQueue>& queues_) {
+  try {
+    std::vector<cl::Platform> platforms;
+    cl::Platform::get(&platforms);
+    if (platforms.size() == 0) {
+      std::cerr << "Platform size 0" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    std::vector<cl::Device> devices;
+    try {
+      platforms[0].getDevices(CL_DEVICE_TYPE_GPU, &devices);
+    } catch (cl::Error) {
+      platforms[0].getDevices(CL_DEVICE_TYPE_CPU, &devices);
+    }
+    if (devices.size() == 1 &&
+        devices[0].getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU &&
+        devices[0].getInfo<CL_DEVICE_EXTENSIONS>().find(
+            "cl_ext_device_fission") != std::string::npos) {
+      cl_device_partition_property_ext properties[] = {
+        CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN_EXT,
+        CL_AFFINITY_DOMAIN_NUMA_EXT,
+        CL_PROPERTIES_LIST_END_EXT
+      };
+      std::vector<cl::Device> sub_devices;
+      try {
+        devices[0].createSubDevices(properties, &sub_devices);
+      } catch (cl::Error) {
+        // No NUMA nodes to split by, keep the whole device
+      }
+      if (sub_devices.size() > 1) {
+        devices = sub_devices;
+      }
+    }
+    cl_context_properties properties[] =
+            { CL_CONTEXT_PLATFORM, cl_context_properties((platforms[0])()),
+              0 };
+    context_ = cl::Context(devices, properties);
+    queues_.clear();
+    for (size_t i = 0; i < devices.size(); ++i) {
+      queues_.push_back(cl::CommandQueue(context_, devices[i]));
+    }
+  } catch (cl::Error error) {
+    std::cerr << "ERROR: "
+              << error.what()
+              << "(" << error.err() << ")"
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+cl::Program load_program(cl::Context& context_, std::string program_name,
+                         std::string options) {
+  std::vector<cl::Device> devices(context_.getInfo<CL_CONTEXT_DEVICES>());
 
-  time_t so_time = 0;
+  // One cached binary per device, named after the options and the device
+  std::string base_name = program_name;
+  for (size_t i = 0; i < options.size(); ++i) {
+    base_name += isalnum(options[i]) ? options[i] : '_';
+  }
+  std::vector<std::string> binary_names;
+  for (size_t d = 0; d < devices.size(); ++d) {
+    std::string device_name = devices[d].getInfo<CL_DEVICE_NAME>();
+    std::string binary_name = base_name + "-";
+    for (size_t i = 0; i < device_name.size(); ++i) {
+      binary_name += isalnum(device_name[i]) ? device_name[i] : '_';
+    }
+    binary_names.push_back(binary_name + ".so");
+  }
+
+  // The binaries are used if all of them are newer than the source
+  bool load_binary = true;
+  struct stat stat_buf;
   time_t cl_time = 1;
-  struct stat stat_buf_so;
-  struct stat stat_buf_cl;
-  int stat_status_so = stat((program_name + ".so").c_str(), &stat_buf_so);
-  int stat_status_cl = stat((program_name + ".cl").c_str(), &stat_buf_cl);
-  if (!stat_status_so && !stat_status_cl) {
-    so_time = stat_buf_so.st_mtime;
-    cl_time = stat_buf_cl.st_mtime;
+  if (!stat((program_name + ".cl").c_str(), &stat_buf)) {
+    cl_time = stat_buf.st_mtime;
+  }
+  for (size_t d = 0; d < binary_names.size(); ++d) {
+    if (stat(binary_names[d].c_str(), &stat_buf) ||
+        stat_buf.st_mtime < cl_time) {
+      load_binary = false;
+    }
   }
 
-  std::ifstream ifs(program_name + ".so");
-  if (!ifs || so_time < cl_time) {
-    if (ifs) ifs.close();
-    load_binary = false;
-    ifs.open(program_name + ".cl");
+  std::vector<std::string> sources;
+  for (size_t d = 0; d < (load_binary ? binary_names.size() : 1); ++d) {
+    std::ifstream ifs(load_binary ? binary_names[d] : program_name + ".cl");
+    sources.push_back(std::string((std::istreambuf_iterator<char>(ifs)),
+                                  std::istreambuf_iterator<char>()));
   }
-  std::string src((std::istreambuf_iterator<char>(ifs)),
-                   std::istreambuf_iterator<char>());
   cl::Program program;
-  std::vector<cl::Device> devices(context_.getInfo<CL_CONTEXT_DEVICES>());
   try {
     if (load_binary) {
-      cl::Program::Binaries bins {
-        std::make_pair(src.c_str(), src.size())
-      };
+      cl::Program::Binaries bins;
+      for (size_t d = 0; d < sources.size(); ++d) {
+        bins.push_back(std::make_pair(sources[d].c_str(), sources[d].size()));
+      }
       program = cl::Program(context_, devices, bins);
     } else {
       cl::Program::Sources source {
-        std::make_pair(src.c_str(), src.size())
+        std::make_pair(sources[0].c_str(), sources[0].size())
       };
       program = cl::Program(context_, source);
     }
-    std::stringstream options;
+    std::stringstream build_options;
+    build_options << options;
     if (!strcmp(devices[0].getInfo<CL_DEVICE_NAME>().c_str(),
                 "GeForce 8800 GT")) {
-      options << "-D FIX_BROKEN_IMAGE_WRITING";
+      build_options << " -D FIX_BROKEN_IMAGE_WRITING";
     }
-    program.build(devices, options.str().c_str());
+    program.build(devices, build_options.str().c_str());
 
     if (!load_binary) {
       std::string log;
       program.getBuildInfo<std::string>(devices[0], CL_PROGRAM_BUILD_LOG, &log);
       std::cerr << log;
 
+      // The binaries come in the order of the devices of the program
       std::vector<size_t> sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
       std::vector<char*> bins = program.getInfo<CL_PROGRAM_BINARIES>(NULL);
-      if (bins.size()) {
-        std::ofstream out(program_name + ".so");
-        std::copy(bins[0], bins[0] + sizes[0],
+      for (size_t d = 0; d < bins.size() && d < binary_names.size(); ++d) {
+        std::ofstream out(binary_names[d]);
+        std::copy(bins[d], bins[d] + sizes[d],
                   std::ostream_iterator<char>(out));
       }
     }
@@ -116,21 +187,33 @@ cl::Program load_program(cl::Context& context_, std::string program_name) {
   return program;
 }
 
-cv::Mat make_rgba(const cv::Mat& image, cv::Mat alpha) {
-  if (alpha.empty()) {
-    alpha = cv::Mat(cv::Mat::ones(image.size(), CV_8U) * 255);
+void reduce_partial_norms(cl::CommandQueue& queue,
+                          cl::Kernel& reduce_norms_partial,
+                          const cl::Buffer* partials, size_t count,
+                          size_t local_size, const cl::Buffer& result) {
+  int current = 0;
+  while (count > 1) {
+    size_t groups = (count + local_size - 1) / local_size;
+    reduce_norms_partial.setArg<cl::Buffer>(0, partials[current]);
+    reduce_norms_partial.setArg<cl_int>(1, cl_int(count));
+    reduce_norms_partial.setArg(2, local_size * sizeof(cl_float4), NULL);
+    reduce_norms_partial.setArg(3, local_size * sizeof(cl_float4), NULL);
+    reduce_norms_partial.setArg<cl::Buffer>(4, groups == 1 ?
+        result : partials[1 - current]);
+    queue.enqueueNDRangeKernel(
+      reduce_norms_partial,
+      cl::NullRange,
+      cl::NDRange(groups * local_size),
+      cl::NDRange(local_size)
+    );
+    count = groups;
+    current = 1 - current;
   }
-  static int fromto[] = {0, 2,  1, 1,  2, 0,  3, 3};
-  cv::Mat with_alpha(image.size(), CV_8UC4);
-  std::array<cv::Mat, 2> images{{image, alpha}};
-  cv::mixChannels(images.data(), int(images.size()), &with_alpha, 1, fromto, 4);
-  return with_alpha;
 }
 
 // FIXME: Doesn't work for GPU/flipped images
-void save_cl_image(std::string filename,
-                   cl::CommandQueue const& queue,
-                   cl::Image2D const& cl_image) {
+cv::Mat read_cl_image(cl::CommandQueue const& queue,
+                      cl::Image2D const& cl_image) {
   size_t width = cl_image.getImageInfo<CL_IMAGE_WIDTH>();
   size_t height = cl_image.getImageInfo<CL_IMAGE_HEIGHT>();
 
@@ -147,6 +230,13 @@ void save_cl_image(std::string filename,
   queue.enqueueReadImage(cl_image, CL_TRUE,
                          origin, region, 0, 0,
                          out_mat.data);
+  return out_mat;
+}
+
+void save_cl_image(std::string filename,
+                   cl::CommandQueue const& queue,
+                   cl::Image2D const& cl_image) {
+  cv::Mat out_mat = read_cl_image(queue, cl_image);
   {
     cv::flip(out_mat, out_mat, 0);
     cv::Mat tmp(out_mat.size(), CV_32FC4);
@@ -1,18 +1,39 @@
 #ifndef OPENCL_H_
 #define OPENCL_H_
 
-#include <GL/glew.h>
-
 #define __CL_ENABLE_EXCEPTIONS
 #include <CL/cl.hpp>
 
-#include <cv.h>
+#include "image.h"
 
 namespace pv {
 
-void init_cl(cl::Context& context_, cl::CommandQueue& queue_, bool with_gl);
-cl::Program load_program(cl::Context& context_, std::string program_name);
-cv::Mat make_rgba(const cv::Mat& image, cv::Mat alpha = cv::Mat());
+// Prefers a GPU and falls back to the CPU, returns the type of the device
+// the queue was created on. sharing holds further context properties, pairs
+// of name and value ending in 0, e.g. for sharing with a GL context.
+cl_device_type init_cl(cl::Context& context_, cl::CommandQueue& queue_,
+                       const cl_context_properties* sharing = NULL);
+// Without GL sharing, but with one queue per device of the first platform:
+// all GPUs, else the CPU. A single CPU is split into one sub-device per NUMA
+// node where the runtime supports device fission.
+void init_cl_devices(cl::Context& context_,
+                     std::vector<cl::CommandQueue>& queues_);
+// Builds program_name.cl with the given compiler options, e.g. -D defines.
+// The binaries are cached per set of options and device name.
+cl::Program load_program(cl::Context& context_, std::string program_name,
+                         std::string options = "");
+// Further stages of a reduction to (sum, maximum) pairs of cl_float4: reduces
+// the count pairs that the first stage left in partials[0] with the
+// reduce_norms_partial kernel of hellocl_kernels.cl, in work-groups of
+// local_size, until the last stage writes its single pair into result. Both
+// partial buffers need room for count pairs.
+void reduce_partial_norms(cl::CommandQueue& queue,
+                          cl::Kernel& reduce_norms_partial,
+                          const cl::Buffer* partials, size_t count,
+                          size_t local_size, const cl::Buffer& result);
+// Reads an image of CL_FLOAT RGBA pixels into a CV_32FC4 matrix
+cv::Mat read_cl_image(cl::CommandQueue const& queue,
+                      cl::Image2D const& cl_image);
 // FIXME: Doesn't work for GPU images
 void save_cl_image(std::string filename,
                    cl::CommandQueue const& queue,
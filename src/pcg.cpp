@@ -0,0 +1,227 @@
+#include "opencl.h"
+#include "pcg.h"
+
+#include <iostream>
+
+namespace pv {
+
+MultigridPCG::MultigridPCG() :
+    preconditioner_(),
+    program_(),
+    calculate_residual(),
+    apply_laplace(),
+    axpy(),
+    quotient(),
+    reset_image(),
+    copy_image(),
+    b_(),
+    x_(),
+    r_(),
+    z_(),
+    z_old_(),
+    p_(),
+    q_(),
+    tmp_(),
+    rz_(),
+    rz_new_(),
+    rz_old_(),
+    pq_(),
+    alpha_(),
+    beta_(),
+    restart_(true) {
+}
+
+void MultigridPCG::init(cl::Context context, cl::CommandQueue queue) {
+  Solver::init(context, queue);
+  preconditioner_.init(context, queue);
+
+  program_ = pv::load_program(context_, "hellocl_kernels");
+  try {
+    calculate_residual = cl::Kernel(program_, "calculate_residual", NULL);
+    apply_laplace = cl::Kernel(program_, "apply_laplace", NULL);
+    axpy = cl::Kernel(program_, "axpy", NULL);
+    quotient = cl::Kernel(program_, "quotient", NULL);
+    reset_image = cl::Kernel(program_, "reset_image", NULL);
+    copy_image = cl::Kernel(program_, "copy_image", NULL);
+  } catch (cl::Error error) {
+    std::cerr << "ERROR: "
+              << error.what()
+              << "(" << error.err() << ")"
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  cl::Buffer* scalars[] = { &rz_, &rz_new_, &rz_old_, &pq_, &alpha_, &beta_ };
+  for (size_t i = 0; i < sizeof(scalars) / sizeof(scalars[0]); ++i) {
+    *scalars[i] = cl::Buffer(context_, CL_MEM_READ_WRITE,
+                             2 * sizeof(cl_float4));
+  }
+}
+
+void MultigridPCG::set_source(cv::Mat source, cv::Mat mask) {
+  preconditioner_.set_source(source, mask);
+  allocate_images();
+}
+
+void MultigridPCG::set_target(cv::Mat target) {
+  preconditioner_.set_target(target);
+  launch_copy(preconditioner_.current_rhs(), b_);
+  launch_copy(preconditioner_.current_solution(), x_);
+  restart_ = true;
+}
+
+void MultigridPCG::set_offset(int off_x, int off_y) {
+  Solver::set_offset(off_x, off_y);
+  preconditioner_.set_offset(off_x, off_y);
+  // Keep x as the initial guess for the moved system
+  launch_copy(preconditioner_.current_rhs(), b_);
+  restart_ = true;
+}
+
+void MultigridPCG::allocate_images() {
+  const cl::Image2D& rhs = preconditioner_.current_rhs();
+  size_t width = rhs.getImageInfo<CL_IMAGE_WIDTH>();
+  size_t height = rhs.getImageInfo<CL_IMAGE_HEIGHT>();
+  cl::Image2D* images[] = { &b_, &x_, &r_, &z_, &z_old_, &p_, &q_, &tmp_ };
+  for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); ++i) {
+    *images[i] = cl::Image2D(context_, CL_MEM_READ_WRITE,
+                             cl::ImageFormat(CL_RGBA, CL_FLOAT),
+                             width, height);
+    reset_image.setArg<cl::Image2D>(0, *images[i]);
+    reset_image.setArg<cl::Buffer>(1, cl::Buffer());
+    queue_.enqueueNDRangeKernel(
+      reset_image,
+      cl::NullRange,
+      cl::NDRange(width, height),
+      cl::NullRange
+    );
+  }
+}
+
+void MultigridPCG::start_calculation_async(double /*number_iterations*/) {
+  if (restart_) {
+    restart();
+    restart_ = false;
+  }
+  iterate();
+}
+
+// r_ has the size of the finest grid of the preconditioner, which reduces it
+// on the device
+float MultigridPCG::get_residual_average() {
+  return preconditioner_.get_norms(r_).average;
+}
+
+void MultigridPCG::restart() {
+  // r = b - A x, z = M r, p = z
+  calculate_residual.setArg<cl::Image2D>(0, b_);
+  calculate_residual.setArg<cl::Image2D>(1, x_);
+  calculate_residual.setArg<cl::Image2D>(2, r_);
+  calculate_residual.setArg<cl::Buffer>(3, cl::Buffer());
+  queue_.enqueueNDRangeKernel(
+    calculate_residual,
+    cl::NullRange,
+    cl::NDRange(r_.getImageInfo<CL_IMAGE_WIDTH>(),
+                r_.getImageInfo<CL_IMAGE_HEIGHT>()),
+    cl::NullRange
+  );
+  launch_precondition(r_, z_);
+  launch_copy(z_, p_);
+  preconditioner_.enqueue_dot_product(r_, z_, rz_);
+}
+
+void MultigridPCG::iterate() {
+  launch_apply_laplace(p_, q_);
+  preconditioner_.enqueue_dot_product(p_, q_, pq_);
+  launch_quotient(rz_, cl::Buffer(), pq_, alpha_);
+
+  // x += alpha p
+  launch_axpy(p_, x_, alpha_, 1.0f, tmp_);
+  std::swap(x_, tmp_);
+  // r -= alpha q
+  launch_axpy(q_, r_, alpha_, -1.0f, tmp_);
+  std::swap(r_, tmp_);
+
+  std::swap(z_, z_old_);
+  launch_precondition(r_, z_);
+  preconditioner_.enqueue_dot_product(r_, z_, rz_new_);
+  preconditioner_.enqueue_dot_product(r_, z_old_, rz_old_);
+
+  // Polak-Ribiere form of beta, which tolerates that the multigrid cycle is
+  // not exactly a symmetric preconditioner
+  launch_quotient(rz_new_, rz_old_, rz_, beta_);
+  launch_axpy(p_, z_, beta_, 1.0f, tmp_);
+  std::swap(p_, tmp_);
+  std::swap(rz_, rz_new_);
+}
+
+void MultigridPCG::launch_apply_laplace(const cl::Image2D& x,
+                                        const cl::Image2D& result) {
+  apply_laplace.setArg<cl::Image2D>(0, b_);
+  apply_laplace.setArg<cl::Image2D>(1, x);
+  apply_laplace.setArg<cl::Image2D>(2, result);
+  queue_.enqueueNDRangeKernel(
+    apply_laplace,
+    cl::NullRange,
+    cl::NDRange(result.getImageInfo<CL_IMAGE_WIDTH>(),
+                result.getImageInfo<CL_IMAGE_HEIGHT>()),
+    cl::NullRange
+  );
+}
+
+void MultigridPCG::launch_axpy(const cl::Image2D& x, const cl::Image2D& y,
+                               const cl::Buffer& alpha, cl_float scale,
+                               const cl::Image2D& result) {
+  axpy.setArg<cl::Image2D>(0, x);
+  axpy.setArg<cl::Image2D>(1, y);
+  axpy.setArg<cl::Image2D>(2, b_);
+  axpy.setArg<cl::Buffer>(3, alpha);
+  axpy.setArg<cl_float>(4, scale);
+  axpy.setArg<cl::Image2D>(5, result);
+  queue_.enqueueNDRangeKernel(
+    axpy,
+    cl::NullRange,
+    cl::NDRange(result.getImageInfo<CL_IMAGE_WIDTH>(),
+                result.getImageInfo<CL_IMAGE_HEIGHT>()),
+    cl::NullRange
+  );
+}
+
+void MultigridPCG::launch_precondition(const cl::Image2D& r,
+                                       const cl::Image2D& z) {
+  preconditioner_.precondition(r);
+  launch_copy(preconditioner_.current_solution(), z);
+}
+
+// The images of the preconditioner may be stored as half floats, so copies
+// go through a kernel that converts between the formats
+void MultigridPCG::launch_copy(const cl::Image2D& src, const cl::Image2D& dst) {
+  copy_image.setArg<cl::Image2D>(0, src);
+  copy_image.setArg<cl::Image2D>(1, dst);
+  queue_.enqueueNDRangeKernel(
+    copy_image,
+    cl::NullRange,
+    cl::NDRange(dst.getImageInfo<CL_IMAGE_WIDTH>(),
+                dst.getImageInfo<CL_IMAGE_HEIGHT>()),
+    cl::NullRange
+  );
+}
+
+// result = (numerator - subtrahend) / denominator, computed on the device.
+// subtrahend may be an empty buffer.
+void MultigridPCG::launch_quotient(const cl::Buffer& numerator,
+                                   const cl::Buffer& subtrahend,
+                                   const cl::Buffer& denominator,
+                                   const cl::Buffer& result) {
+  quotient.setArg<cl::Buffer>(0, numerator);
+  quotient.setArg<cl::Buffer>(1, subtrahend);
+  quotient.setArg<cl::Buffer>(2, denominator);
+  quotient.setArg<cl::Buffer>(3, result);
+  queue_.enqueueNDRangeKernel(
+    quotient,
+    cl::NullRange,
+    cl::NDRange(1),
+    cl::NullRange
+  );
+}
+
+}
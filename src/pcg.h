@@ -0,0 +1,82 @@
+#ifndef PCG_H_
+#define PCG_H_
+
+#include "context.h"
+
+namespace pv {
+
+// Flexible preconditioned conjugate gradients over the masked unknowns, with
+// one multigrid cycle of a SimpleVCycle as the preconditioner. Each channel
+// is solved as its own system, so all scalars are per channel. The scalars
+// are reduced and combined on the device, an iteration never waits for it.
+class MultigridPCG : public Solver {
+ public:
+  MultigridPCG();
+
+  void set_source(cv::Mat source, cv::Mat mask);
+  void set_target(cv::Mat target);
+
+  void init(cl::Context context, cl::CommandQueue queue);
+  void set_offset(int off_x, int off_y);
+  void get_domain(int& x, int& y, int& width, int& height) {
+    preconditioner_.get_domain(x, y, width, height);
+  }
+
+  void start_calculation_async(double number_iterations);
+  float get_residual_average();
+
+  const cl::Image2D& current_solution() { return x_; }
+  const cl::Image2D& current_residual() { return r_; }
+
+  SimpleVCycle& preconditioner() { return preconditioner_; }
+
+ private:
+  void restart();
+  void iterate();
+  void allocate_images();
+
+  // kernel launchers
+  void launch_apply_laplace(const cl::Image2D& x, const cl::Image2D& result);
+  void launch_axpy(const cl::Image2D& x, const cl::Image2D& y,
+                   const cl::Buffer& alpha, cl_float scale,
+                   const cl::Image2D& result);
+  void launch_precondition(const cl::Image2D& r, const cl::Image2D& z);
+  void launch_copy(const cl::Image2D& src, const cl::Image2D& dst);
+  void launch_quotient(const cl::Buffer& numerator,
+                       const cl::Buffer& subtrahend,
+                       const cl::Buffer& denominator,
+                       const cl::Buffer& result);
+
+  SimpleVCycle preconditioner_;
+
+  cl::Program program_;
+  cl::Kernel calculate_residual;
+  cl::Kernel apply_laplace;
+  cl::Kernel axpy;
+  cl::Kernel quotient;
+  cl::Kernel reset_image;
+  cl::Kernel copy_image;
+
+  cl::Image2D b_;
+  cl::Image2D x_;
+  cl::Image2D r_;
+  cl::Image2D z_;
+  cl::Image2D z_old_;
+  cl::Image2D p_;
+  cl::Image2D q_;
+  cl::Image2D tmp_;
+
+  // Per channel scalars on the device. The dot products are reduced into
+  // pairs of (sum, maximum) and use the first cl_float4.
+  cl::Buffer rz_;
+  cl::Buffer rz_new_;
+  cl::Buffer rz_old_;
+  cl::Buffer pq_;
+  cl::Buffer alpha_;
+  cl::Buffer beta_;
+  bool restart_;
+};
+
+}
+
+#endif  // PCG_H_
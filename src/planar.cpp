@@ -0,0 +1,460 @@
+#include "opencl.h"
+#include "planar.h"
+
+#include <iostream>
+
+namespace pv {
+
+PlanarVCycle::PlanarVCycle() :
+    program_(),
+    image_program_(),
+    setup_system(),
+    reset_image(),
+    split_system(),
+    pack_planes(),
+    planar_gauss_seidel(),
+    planar_residual(),
+    planar_restrict(),
+    planar_restrict_mask(),
+    planar_interp_add(),
+    planar_reset(),
+    planar_reduce_norms(),
+    reduce_norms_partial(),
+    planar_update_boundary(),
+    rim_pixels_(),
+    residual_partials_(),
+    residual_result_(),
+    residual_norms_(),
+    residual_read_(),
+    b_image_(),
+    x_image_(),
+    residual_image_(),
+    width_(),
+    strip_(),
+    size_stack(),
+    b_stack(),
+    x_stack(),
+    residual_stack(),
+    mask_stack() {
+}
+
+void PlanarVCycle::init(cl::Context context, cl::CommandQueue queue) {
+  init(context, queue, pv::load_program(context, "hellocl_kernels"),
+       pv::load_program(context, "planar_kernels"));
+}
+
+void PlanarVCycle::init(cl::Context context, cl::CommandQueue queue,
+                        cl::Program image_program, cl::Program program) {
+  Solver::init(context, queue);
+
+  image_program_ = image_program;
+  program_ = program;
+  try {
+    setup_system = cl::Kernel(image_program_, "setup_system", NULL);
+    reset_image = cl::Kernel(image_program_, "reset_image", NULL);
+    split_system = cl::Kernel(program_, "split_system", NULL);
+    pack_planes = cl::Kernel(program_, "pack_planes", NULL);
+    planar_gauss_seidel = cl::Kernel(program_, "planar_gauss_seidel", NULL);
+    planar_residual = cl::Kernel(program_, "planar_residual", NULL);
+    planar_restrict = cl::Kernel(program_, "planar_restrict", NULL);
+    planar_restrict_mask = cl::Kernel(program_, "planar_restrict_mask", NULL);
+    planar_interp_add = cl::Kernel(program_, "planar_interp_add", NULL);
+    planar_reset = cl::Kernel(program_, "planar_reset", NULL);
+    planar_reduce_norms = cl::Kernel(program_, "planar_reduce_norms", NULL);
+    reduce_norms_partial = cl::Kernel(image_program_, "reduce_norms_partial",
+                                      NULL);
+    planar_update_boundary = cl::Kernel(program_, "planar_update_boundary",
+                                        NULL);
+  } catch (cl::Error error) {
+    std::cerr << "ERROR: "
+              << error.what()
+              << "(" << error.err() << ")"
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  residual_result_ = cl::Buffer(context_, CL_MEM_READ_WRITE,
+                                2 * sizeof(cl_float4));
+}
+
+void PlanarVCycle::set_source(cv::Mat source, cv::Mat mask) {
+  Solver::set_source(source, mask);
+
+  cl::Image2D* images[] = { &b_image_, &x_image_, &residual_image_ };
+  for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); ++i) {
+    *images[i] = cl::Image2D(context_, CL_MEM_READ_WRITE,
+                             cl::ImageFormat(CL_RGBA, CL_FLOAT),
+                             size_t(source_.cols), size_t(source_.rows));
+    launch_reset_image(*images[i]);
+  }
+  Strip whole = { 0, source_.rows, 0, source_.rows, 0, source_.rows };
+  set_strip(source_.cols, whole, true);
+  rim_pixels_ = create_rim_buffer();
+}
+
+void PlanarVCycle::set_target(cv::Mat target) {
+  Solver::set_target(target);
+  setup_new_system(true);
+}
+
+void PlanarVCycle::next_frame(cv::Mat target) {
+  Solver::set_target(target);
+  setup_new_system(false);
+}
+
+void PlanarVCycle::set_offset(int off_x, int off_y) {
+  Solver::set_offset(off_x, off_y);
+  setup_new_system(false);
+}
+
+void PlanarVCycle::set_strip(int width, const Strip& strip,
+                             bool coarse_grids) {
+  width_ = width;
+  strip_ = strip;
+  build_multigrid(coarse_grids);
+}
+
+void PlanarVCycle::build_multigrid(bool coarse_grids) {
+  size_stack.clear();
+  b_stack.clear();
+  x_stack.clear();
+  residual_stack.clear();
+  mask_stack.clear();
+
+  GridSize size = { width_, strip_.rows, aligned_pitch(width_) };
+  for (;;) {
+    size_stack.push_back(size);
+    size_t count = size_t(size.pitch) * size_t(size.height);
+    std::vector<cl::Buffer*> planes;
+    b_stack.push_back(cl::Buffer());
+    x_stack.push_back(cl::Buffer());
+    residual_stack.push_back(cl::Buffer());
+    planes.push_back(&b_stack.back());
+    planes.push_back(&x_stack.back());
+    planes.push_back(&residual_stack.back());
+    for (size_t i = 0; i < planes.size(); ++i) {
+      *planes[i] = cl::Buffer(context_, CL_MEM_READ_WRITE,
+                              CHANNELS * count * sizeof(cl_float));
+      launch_reset(*planes[i], CHANNELS * count);
+    }
+    mask_stack.push_back(cl::Buffer(context_, CL_MEM_READ_WRITE,
+                                    count * sizeof(cl_uchar)));
+    if (!coarse_grids || size.width == 1 || size.height == 1) {
+      break;
+    }
+    size.width = (size.width + 1) / 2;
+    size.height = (size.height + 1) / 2;
+    size.pitch = aligned_pitch(size.width);
+  }
+
+  size_t count = size_t((strip_.own_end - strip_.own_begin) *
+                        size_stack[0].pitch / PITCH_ALIGNMENT);
+  size_t groups = (count + REDUCE_LOCAL_SIZE - 1) / REDUCE_LOCAL_SIZE;
+  for (int i = 0; i < 2; ++i) {
+    residual_partials_[i] = cl::Buffer(context_, CL_MEM_READ_WRITE,
+                                       2 * groups * sizeof(cl_float4));
+  }
+}
+
+void PlanarVCycle::setup_new_system(bool initialize) {
+  if (!initialize) {
+    cl_int2 offset = {{pos_x_ + domain_x_, pos_y_ + domain_y_}};
+    launch_update_boundary(cl_source_, cl_target_, rim_pixels_, rim_.size(),
+                           offset);
+    return;
+  }
+  setup_system.setArg<cl::Image2D>(0, cl_source_);
+  setup_system.setArg<cl::Image2D>(1, cl_target_);
+  setup_system.setArg<cl::Image2D>(2, b_image_);
+  setup_system.setArg<cl::Image2D>(3, x_image_);
+  setup_system.setArg<cl_int>(4, pos_x_ + domain_x_);
+  setup_system.setArg<cl_int>(5, pos_y_ + domain_y_);
+  setup_system.setArg<cl_int>(6, initialize);
+  queue_.enqueueNDRangeKernel(
+    setup_system,
+    cl::NullRange,
+    cl::NDRange(cl_source_.getImageInfo<CL_IMAGE_WIDTH>(),
+                cl_source_.getImageInfo<CL_IMAGE_HEIGHT>()),
+    cl::NullRange
+  );
+  split(b_image_, x_image_, initialize);
+}
+
+void PlanarVCycle::split(const cl::Image2D& b, const cl::Image2D& x,
+                         bool initialize) {
+  cl_int2 interior = {{strip_.interior_begin, strip_.interior_end}};
+  split_system.setArg<cl::Image2D>(0, b);
+  split_system.setArg<cl::Image2D>(1, x);
+  split_system.setArg<cl::Buffer>(2, b_stack[0]);
+  split_system.setArg<cl::Buffer>(3, x_stack[0]);
+  split_system.setArg<cl::Buffer>(4, mask_stack[0]);
+  split_system.setArg<cl_int>(5, size_stack[0].pitch);
+  split_system.setArg<cl_int>(6, cl_int(plane_size(0)));
+  split_system.setArg<cl_int>(7, strip_.first_row);
+  split_system.setArg<cl_int2>(8, interior);
+  split_system.setArg<cl_int>(9, initialize);
+  queue_.enqueueNDRangeKernel(
+    split_system,
+    cl::NullRange,
+    cl::NDRange(size_t(size_stack[0].width), size_t(size_stack[0].height)),
+    cl::NullRange
+  );
+
+  if (!initialize) {
+    return;
+  }
+  // The masks of the coarser grids only depend on the source
+  for (size_t level = 1; level < mask_stack.size(); ++level) {
+    const GridSize& fine = size_stack[level - 1];
+    cl_int2 fine_size = {{fine.width, fine.height}};
+    planar_restrict_mask.setArg<cl::Buffer>(0, mask_stack[level - 1]);
+    planar_restrict_mask.setArg<cl::Buffer>(1, mask_stack[level]);
+    planar_restrict_mask.setArg<cl_int2>(2, fine_size);
+    planar_restrict_mask.setArg<cl_int>(3, fine.pitch);
+    planar_restrict_mask.setArg<cl_int>(4, size_stack[level].pitch);
+    queue_.enqueueNDRangeKernel(
+      planar_restrict_mask,
+      cl::NullRange,
+      cl::NDRange(size_t(size_stack[level].width),
+                  size_t(size_stack[level].height)),
+      cl::NullRange
+    );
+  }
+}
+
+void PlanarVCycle::start_calculation_async(double number_iterations) {
+  for (int i = 0; i < int(number_iterations); ++i) {
+    multigrid_cycle(0);
+  }
+}
+
+void PlanarVCycle::multigrid_cycle(size_t level) {
+  if (level == size_stack.size() - 1) {
+    return;
+  }
+  smooth(level, false);
+  launch_residual(level);
+  coarse_grid_correction(level);
+  smooth(level, true);
+  if (level == 0) {
+    launch_residual(0);
+  }
+}
+
+void PlanarVCycle::coarse_grid_correction(size_t level) {
+  launch_restrict(level + 1);
+  launch_reset(x_stack[level + 1], CHANNELS * plane_size(level + 1));
+  multigrid_cycle(level + 1);
+  launch_interp_add(level);
+}
+
+void PlanarVCycle::smooth(size_t level, bool reverse) {
+  const GridSize& size = size_stack[level];
+  // The finest grid has a five point stencil, coarser grids nine points
+  cl_int colours = level == 0 ? 2 : 4;
+  cl_int2 grid_size = {{size.width, size.height}};
+  size_t glob_width = size_t(size.width + 1) / 2;
+  size_t glob_height = colours == 2 ? size_t(size.height)
+                                    : size_t(size.height + 1) / 2;
+
+  planar_gauss_seidel.setArg<cl::Buffer>(0, b_stack[level]);
+  planar_gauss_seidel.setArg<cl::Buffer>(1, x_stack[level]);
+  planar_gauss_seidel.setArg<cl::Buffer>(2, mask_stack[level]);
+  planar_gauss_seidel.setArg<cl_int2>(3, grid_size);
+  planar_gauss_seidel.setArg<cl_int>(4, size.pitch);
+  planar_gauss_seidel.setArg<cl_int>(5, cl_int(plane_size(level)));
+  planar_gauss_seidel.setArg<cl_int>(6, colours);
+  for (cl_int c = 0; c < colours; ++c) {
+    planar_gauss_seidel.setArg<cl_int>(7, reverse ? colours - 1 - c : c);
+    queue_.enqueueNDRangeKernel(
+      planar_gauss_seidel,
+      cl::NullRange,
+      cl::NDRange(glob_width, glob_height, CHANNELS),
+      cl::NullRange
+    );
+  }
+}
+
+float PlanarVCycle::get_residual_average() {
+  enqueue_residual_sum();
+  return float(finish_residual_sum() /
+               double(width_ * (strip_.own_end - strip_.own_begin)));
+}
+
+void PlanarVCycle::enqueue_residual_sum() {
+  cl_int pitch = size_stack[0].pitch;
+  size_t count = size_t((strip_.own_end - strip_.own_begin) * pitch /
+                        PITCH_ALIGNMENT);
+  size_t groups = (count + REDUCE_LOCAL_SIZE - 1) / REDUCE_LOCAL_SIZE;
+  planar_reduce_norms.setArg<cl::Buffer>(0, residual_stack[0]);
+  planar_reduce_norms.setArg<cl_int>(
+      1, strip_.own_begin * pitch / PITCH_ALIGNMENT);
+  planar_reduce_norms.setArg<cl_int>(2, cl_int(count));
+  planar_reduce_norms.setArg<cl_int>(
+      3, cl_int(plane_size(0)) / PITCH_ALIGNMENT);
+  planar_reduce_norms.setArg(4, REDUCE_LOCAL_SIZE * sizeof(cl_float4), NULL);
+  planar_reduce_norms.setArg(5, REDUCE_LOCAL_SIZE * sizeof(cl_float4), NULL);
+  planar_reduce_norms.setArg<cl::Buffer>(6, groups == 1 ?
+      residual_result_ : residual_partials_[0]);
+  queue_.enqueueNDRangeKernel(
+    planar_reduce_norms,
+    cl::NullRange,
+    cl::NDRange(groups * REDUCE_LOCAL_SIZE),
+    cl::NDRange(REDUCE_LOCAL_SIZE)
+  );
+  reduce_partial_norms(queue_, reduce_norms_partial, residual_partials_,
+                       groups, REDUCE_LOCAL_SIZE, residual_result_);
+  queue_.enqueueReadBuffer(residual_result_, CL_FALSE, 0,
+                           2 * sizeof(cl_float4), residual_norms_, NULL,
+                           &residual_read_);
+  queue_.flush();
+}
+
+double PlanarVCycle::finish_residual_sum() {
+  residual_read_.wait();
+  return double(residual_norms_[0].s[0]) + double(residual_norms_[0].s[1]) +
+         double(residual_norms_[0].s[2]);
+}
+
+const cl::Image2D& PlanarVCycle::current_solution() {
+  launch_pack(x_stack[0], x_image_, true);
+  return x_image_;
+}
+
+const cl::Image2D& PlanarVCycle::current_residual() {
+  launch_pack(residual_stack[0], residual_image_, false);
+  return residual_image_;
+}
+
+// Rows start at multiples of PITCH_ALIGNMENT floats, so that the planes can
+// be loaded as float4 and CPU devices vectorize along the rows.
+cl_int PlanarVCycle::aligned_pitch(cl_int width) {
+  return (width + PITCH_ALIGNMENT - 1) / PITCH_ALIGNMENT * PITCH_ALIGNMENT;
+}
+
+size_t PlanarVCycle::plane_size(size_t level) const {
+  return size_t(size_stack[level].pitch) * size_t(size_stack[level].height);
+}
+
+void PlanarVCycle::launch_residual(size_t level) {
+  const GridSize& size = size_stack[level];
+  cl_int2 grid_size = {{size.width, size.height}};
+  planar_residual.setArg<cl::Buffer>(0, b_stack[level]);
+  planar_residual.setArg<cl::Buffer>(1, x_stack[level]);
+  planar_residual.setArg<cl::Buffer>(2, residual_stack[level]);
+  planar_residual.setArg<cl::Buffer>(3, mask_stack[level]);
+  planar_residual.setArg<cl_int2>(4, grid_size);
+  planar_residual.setArg<cl_int>(5, size.pitch);
+  planar_residual.setArg<cl_int>(6, cl_int(plane_size(level)));
+  queue_.enqueueNDRangeKernel(
+    planar_residual,
+    cl::NullRange,
+    cl::NDRange(size_t(size.width), size_t(size.height), CHANNELS),
+    cl::NullRange
+  );
+}
+
+// Restricts the residual of the next finer grid into b of level
+void PlanarVCycle::launch_restrict(size_t level) {
+  const GridSize& fine = size_stack[level - 1];
+  const GridSize& coarse = size_stack[level];
+  cl_int2 fine_size = {{fine.width, fine.height}};
+  planar_restrict.setArg<cl::Buffer>(0, residual_stack[level - 1]);
+  planar_restrict.setArg<cl::Buffer>(1, b_stack[level]);
+  planar_restrict.setArg<cl_int2>(2, fine_size);
+  planar_restrict.setArg<cl_int>(3, fine.pitch);
+  planar_restrict.setArg<cl_int>(4, cl_int(plane_size(level - 1)));
+  planar_restrict.setArg<cl_int>(5, coarse.pitch);
+  planar_restrict.setArg<cl_int>(6, cl_int(plane_size(level)));
+  queue_.enqueueNDRangeKernel(
+    planar_restrict,
+    cl::NullRange,
+    cl::NDRange(size_t(coarse.width), size_t(coarse.height), CHANNELS),
+    cl::NullRange
+  );
+}
+
+// Adds the interpolated solution of the next coarser grid to x of level
+void PlanarVCycle::launch_interp_add(size_t level) {
+  const GridSize& fine = size_stack[level];
+  const GridSize& coarse = size_stack[level + 1];
+  cl_int2 coarse_size = {{coarse.width, coarse.height}};
+  planar_interp_add.setArg<cl::Buffer>(0, x_stack[level + 1]);
+  planar_interp_add.setArg<cl::Buffer>(1, x_stack[level]);
+  planar_interp_add.setArg<cl::Buffer>(2, mask_stack[level]);
+  planar_interp_add.setArg<cl_int2>(3, coarse_size);
+  planar_interp_add.setArg<cl_int>(4, coarse.pitch);
+  planar_interp_add.setArg<cl_int>(5, cl_int(plane_size(level + 1)));
+  planar_interp_add.setArg<cl_int>(6, fine.pitch);
+  planar_interp_add.setArg<cl_int>(7, cl_int(plane_size(level)));
+  queue_.enqueueNDRangeKernel(
+    planar_interp_add,
+    cl::NullRange,
+    cl::NDRange(size_t(fine.width), size_t(fine.height), CHANNELS),
+    cl::NullRange
+  );
+}
+
+void PlanarVCycle::launch_reset(const cl::Buffer& buffer, size_t count) {
+  planar_reset.setArg<cl::Buffer>(0, buffer);
+  queue_.enqueueNDRangeKernel(
+    planar_reset,
+    cl::NullRange,
+    cl::NDRange(count / PITCH_ALIGNMENT),
+    cl::NullRange
+  );
+}
+
+void PlanarVCycle::launch_reset_image(const cl::Image2D& image) {
+  reset_image.setArg<cl::Image2D>(0, image);
+  reset_image.setArg<cl::Buffer>(1, cl::Buffer());
+  queue_.enqueueNDRangeKernel(
+    reset_image,
+    cl::NullRange,
+    cl::NDRange(image.getImageInfo<CL_IMAGE_WIDTH>(),
+                image.getImageInfo<CL_IMAGE_HEIGHT>()),
+    cl::NullRange
+  );
+}
+
+void PlanarVCycle::launch_update_boundary(const cl::Image2D& source,
+                                          const cl::Image2D& target,
+                                          const cl::Buffer& rim, size_t count,
+                                          cl_int2 offset) {
+  if (count == 0) {
+    return;
+  }
+  planar_update_boundary.setArg<cl::Image2D>(0, source);
+  planar_update_boundary.setArg<cl::Image2D>(1, target);
+  planar_update_boundary.setArg<cl::Buffer>(2, b_stack[0]);
+  planar_update_boundary.setArg<cl::Buffer>(3, rim);
+  planar_update_boundary.setArg<cl_int2>(4, offset);
+  planar_update_boundary.setArg<cl_int>(5, size_stack[0].pitch);
+  planar_update_boundary.setArg<cl_int>(6, cl_int(plane_size(0)));
+  planar_update_boundary.setArg<cl_int>(7, strip_.first_row);
+  planar_update_boundary.setArg<cl_int>(8, strip_.rows);
+  queue_.enqueueNDRangeKernel(
+    planar_update_boundary,
+    cl::NullRange,
+    cl::NDRange(count),
+    cl::NullRange
+  );
+}
+
+void PlanarVCycle::launch_pack(const cl::Buffer& planes,
+                               const cl::Image2D& image, bool solution) {
+  pack_planes.setArg<cl::Buffer>(0, planes);
+  pack_planes.setArg<cl::Buffer>(1, mask_stack[0]);
+  pack_planes.setArg<cl::Image2D>(2, image);
+  pack_planes.setArg<cl_int>(3, size_stack[0].pitch);
+  pack_planes.setArg<cl_int>(4, cl_int(plane_size(0)));
+  pack_planes.setArg<cl_int>(5, strip_.first_row);
+  pack_planes.setArg<cl_int>(6, solution);
+  queue_.enqueueNDRangeKernel(
+    pack_planes,
+    cl::NDRange(0, size_t(strip_.own_begin)),
+    cl::NDRange(size_t(width_), size_t(strip_.own_end - strip_.own_begin)),
+    cl::NullRange
+  );
+}
+
+}
@@ -0,0 +1,144 @@
+#ifndef PLANAR_H_
+#define PLANAR_H_
+
+#include "solver.h"
+
+#include <vector>
+
+namespace pv {
+
+// V-cycle multigrid with red-black Gauss-Seidel smoothing on a planar layout:
+// every grid keeps b, x and the residual as buffers with one float plane per
+// colour channel, and the grid spacing in a separate uchar mask plane. RGB
+// data thus moves 12 instead of 16 bytes per pixel and field, and the mask
+// costs one byte per pixel and grid. Plain buffer loads also avoid the
+// emulated image access of CPU devices, where GLContext picks this solver.
+class PlanarVCycle : public Solver {
+ public:
+  // Rows of the domain a solver works on, the whole domain unless it is a
+  // strip of MultiDeviceVCycle. All rows are counted from first_row.
+  struct Strip {
+    // First row of the domain and number of rows in the grids
+    cl_int first_row;
+    cl_int rows;
+    // Rows inside [interior_begin, interior_end) are solved for, the rows
+    // outside are fixed boundary values
+    cl_int interior_begin;
+    cl_int interior_end;
+    // Rows that go into current_solution()
+    cl_int own_begin;
+    cl_int own_end;
+  };
+
+  PlanarVCycle();
+
+  void set_source(cv::Mat source, cv::Mat mask);
+  void set_target(cv::Mat target);
+  void next_frame(cv::Mat target);
+
+  void init(cl::Context context, cl::CommandQueue queue);
+  void set_offset(int off_x, int off_y);
+
+  void start_calculation_async(double number_iterations);
+  float get_residual_average();
+
+  // Both pack the planes into an RGBA image first
+  const cl::Image2D& current_solution();
+  const cl::Image2D& current_residual();
+
+ private:
+  struct GridSize {
+    cl_int width;
+    cl_int height;
+    cl_int pitch;
+  };
+
+  static const int CHANNELS = 3;
+  static const size_t REDUCE_LOCAL_SIZE = 256;
+  static const int PITCH_ALIGNMENT = 4;
+
+  friend class MultiDeviceVCycle;
+
+  // Builds the kernels from the already loaded hellocl_kernels and
+  // planar_kernels programs, which the strips of MultiDeviceVCycle share
+  void init(cl::Context context, cl::CommandQueue queue,
+            cl::Program image_program, cl::Program program);
+
+  // Sets up the whole system with initialize, otherwise only rewrites the
+  // equations of the rim for the current target and offset
+  void setup_new_system(bool initialize);
+  // Sets up the grids for strip of a domain width pixels wide, only the
+  // finest one without coarse_grids
+  void set_strip(int width, const Strip& strip, bool coarse_grids);
+  void build_multigrid(bool coarse_grids);
+  // Splits the RGBA system of the domain into the planes of the finest grid
+  void split(const cl::Image2D& b, const cl::Image2D& x, bool initialize);
+  // Sum of squares of the finest residual over the own rows, reduced on the
+  // device. finish_residual_sum() waits for the last enqueued one.
+  void enqueue_residual_sum();
+  double finish_residual_sum();
+  void multigrid_cycle(size_t level);
+  // Corrects x of level with the solution for its residual on the coarser
+  // grids
+  void coarse_grid_correction(size_t level);
+  // Post-smoothing passes the colours in reverse order
+  void smooth(size_t level, bool reverse);
+  size_t plane_size(size_t level) const;
+  static cl_int aligned_pitch(cl_int width);
+
+  // kernel launchers
+  void launch_residual(size_t level);
+  void launch_restrict(size_t level);
+  void launch_interp_add(size_t level);
+  void launch_reset(const cl::Buffer& buffer, size_t count);
+  void launch_reset_image(const cl::Image2D& image);
+  // Rewrites b of the count pixels of rim, in domain coordinates, that fall
+  // into the rows of the finest grid, for target at offset
+  void launch_update_boundary(const cl::Image2D& source,
+                              const cl::Image2D& target,
+                              const cl::Buffer& rim, size_t count,
+                              cl_int2 offset);
+  // Packs the own rows of planes into image, an image of the domain
+  void launch_pack(const cl::Buffer& planes, const cl::Image2D& image,
+                   bool solution);
+
+  cl::Program program_;
+  cl::Program image_program_;
+  cl::Kernel setup_system;
+  cl::Kernel reset_image;
+  cl::Kernel split_system;
+  cl::Kernel pack_planes;
+  cl::Kernel planar_gauss_seidel;
+  cl::Kernel planar_residual;
+  cl::Kernel planar_restrict;
+  cl::Kernel planar_restrict_mask;
+  cl::Kernel planar_interp_add;
+  cl::Kernel planar_reset;
+  cl::Kernel planar_reduce_norms;
+  cl::Kernel reduce_norms_partial;
+  cl::Kernel planar_update_boundary;
+  // cl_int2 coordinates of Solver::rim_
+  cl::Buffer rim_pixels_;
+  // Stages of the residual reduction, and its (sum, maximum) result
+  cl::Buffer residual_partials_[2];
+  cl::Buffer residual_result_;
+  cl_float4 residual_norms_[2];
+  cl::Event residual_read_;
+
+  // RGBA images of the finest grid for setup_system and for drawing
+  cl::Image2D b_image_;
+  cl::Image2D x_image_;
+  cl::Image2D residual_image_;
+
+  int width_;
+  Strip strip_;
+  std::vector<GridSize> size_stack;
+  std::vector<cl::Buffer> b_stack;
+  std::vector<cl::Buffer> x_stack;
+  std::vector<cl::Buffer> residual_stack;
+  std::vector<cl::Buffer> mask_stack;
+};
+
+}
+
+#endif  // PLANAR_H_
@@ -0,0 +1,149 @@
+#include "opencl.h"
+#include "refinement.h"
+
+#include <algorithm>
+#include <iostream>
+
+namespace pv {
+
+IterativeRefinement::IterativeRefinement() :
+    inner_(),
+    program_(),
+    setup_system(),
+    calculate_residual(),
+    axpy(),
+    reset_image(),
+    one_(),
+    b_(),
+    x_(),
+    r_(),
+    tmp_() {
+  inner_.set_precision(SimpleVCycle::HALF_PRECISION);
+}
+
+void IterativeRefinement::init(cl::Context context, cl::CommandQueue queue) {
+  Solver::init(context, queue);
+  inner_.init(context, queue);
+
+  program_ = pv::load_program(context_, "hellocl_kernels");
+  try {
+    setup_system = cl::Kernel(program_, "setup_system", NULL);
+    calculate_residual = cl::Kernel(program_, "calculate_residual", NULL);
+    axpy = cl::Kernel(program_, "axpy", NULL);
+    reset_image = cl::Kernel(program_, "reset_image", NULL);
+  } catch (cl::Error error) {
+    std::cerr << "ERROR: "
+              << error.what()
+              << "(" << error.err() << ")"
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  cl_float4 one = {{1.0f, 1.0f, 1.0f, 1.0f}};
+  one_ = cl::Buffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                    sizeof(cl_float4), &one);
+}
+
+void IterativeRefinement::set_source(cv::Mat source, cv::Mat mask) {
+  inner_.set_source(source, mask);
+  share_source(inner_);
+
+  cl::Image2D* images[] = { &b_, &x_, &r_, &tmp_ };
+  for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); ++i) {
+    *images[i] = cl::Image2D(context_, CL_MEM_READ_WRITE,
+                             cl::ImageFormat(CL_RGBA, CL_FLOAT),
+                             size_t(source_.cols), size_t(source_.rows));
+    launch_reset_image(*images[i]);
+  }
+}
+
+void IterativeRefinement::set_target(cv::Mat target) {
+  inner_.set_target(target);
+  share_target(inner_);
+  setup_new_system(true);
+}
+
+void IterativeRefinement::set_offset(int off_x, int off_y) {
+  Solver::set_offset(off_x, off_y);
+  inner_.set_offset(off_x, off_y);
+  setup_new_system(false);
+}
+
+// The float system is set up from the source and target directly, as the
+// right hand side of the inner solver may already be rounded to half floats.
+void IterativeRefinement::setup_new_system(bool initialize) {
+  setup_system.setArg<cl::Image2D>(0, cl_source_);
+  setup_system.setArg<cl::Image2D>(1, cl_target_);
+  setup_system.setArg<cl::Image2D>(2, b_);
+  setup_system.setArg<cl::Image2D>(3, x_);
+  setup_system.setArg<cl_int>(4, pos_x_ + domain_x_);
+  setup_system.setArg<cl_int>(5, pos_y_ + domain_y_);
+  setup_system.setArg<cl_int>(6, initialize);
+  queue_.enqueueNDRangeKernel(
+    setup_system,
+    cl::NullRange,
+    cl::NDRange(cl_source_.getImageInfo<CL_IMAGE_WIDTH>(),
+                cl_source_.getImageInfo<CL_IMAGE_HEIGHT>()),
+    cl::NullRange
+  );
+  launch_residual();
+}
+
+void IterativeRefinement::start_calculation_async(double number_iterations) {
+  for (int i = 0; i < int(number_iterations); ++i) {
+    refine();
+  }
+}
+
+void IterativeRefinement::refine() {
+  // Solve A e = r approximately, x += e, r = b - A x
+  inner_.precondition(r_);
+  axpy.setArg<cl::Image2D>(0, inner_.current_solution());
+  axpy.setArg<cl::Image2D>(1, x_);
+  axpy.setArg<cl::Image2D>(2, b_);
+  axpy.setArg<cl::Buffer>(3, one_);
+  axpy.setArg<cl_float>(4, 1.0f);
+  axpy.setArg<cl::Image2D>(5, tmp_);
+  queue_.enqueueNDRangeKernel(
+    axpy,
+    cl::NullRange,
+    cl::NDRange(x_.getImageInfo<CL_IMAGE_WIDTH>(),
+                x_.getImageInfo<CL_IMAGE_HEIGHT>()),
+    cl::NullRange
+  );
+  std::swap(x_, tmp_);
+  launch_residual();
+}
+
+// r_ has the size of the finest grid of the inner solver, which reduces it
+// on the device
+float IterativeRefinement::get_residual_average() {
+  return inner_.get_norms(r_).average;
+}
+
+void IterativeRefinement::launch_residual() {
+  calculate_residual.setArg<cl::Image2D>(0, b_);
+  calculate_residual.setArg<cl::Image2D>(1, x_);
+  calculate_residual.setArg<cl::Image2D>(2, r_);
+  calculate_residual.setArg<cl::Buffer>(3, cl::Buffer());
+  queue_.enqueueNDRangeKernel(
+    calculate_residual,
+    cl::NullRange,
+    cl::NDRange(r_.getImageInfo<CL_IMAGE_WIDTH>(),
+                r_.getImageInfo<CL_IMAGE_HEIGHT>()),
+    cl::NullRange
+  );
+}
+
+void IterativeRefinement::launch_reset_image(const cl::Image2D& image) {
+  reset_image.setArg<cl::Image2D>(0, image);
+  reset_image.setArg<cl::Buffer>(1, cl::Buffer());
+  queue_.enqueueNDRangeKernel(
+    reset_image,
+    cl::NullRange,
+    cl::NDRange(image.getImageInfo<CL_IMAGE_WIDTH>(),
+                image.getImageInfo<CL_IMAGE_HEIGHT>()),
+    cl::NullRange
+  );
+}
+
+}
@@ -0,0 +1,61 @@
+#ifndef REFINEMENT_H_
+#define REFINEMENT_H_
+
+#include "context.h"
+
+namespace pv {
+
+// Mixed precision iterative refinement: the system and its solution are kept
+// in float, every step computes the true residual of the finest grid in
+// float and adds the correction that one cycle of the inner SimpleVCycle
+// finds for it. The inner solver may store its grids as half floats, its
+// rounding errors only enter through the corrections and get corrected again
+// by the following steps.
+class IterativeRefinement : public Solver {
+ public:
+  IterativeRefinement();
+
+  void set_source(cv::Mat source, cv::Mat mask);
+  void set_target(cv::Mat target);
+
+  void init(cl::Context context, cl::CommandQueue queue);
+  void set_offset(int off_x, int off_y);
+
+  // Runs number_iterations refinement steps
+  void start_calculation_async(double number_iterations);
+  float get_residual_average();
+
+  const cl::Image2D& current_solution() { return x_; }
+  const cl::Image2D& current_residual() { return r_; }
+
+  // Defaults to SimpleVCycle::HALF_PRECISION storage
+  SimpleVCycle& inner_solver() { return inner_; }
+
+ private:
+  void setup_new_system(bool initialize);
+  void refine();
+
+  // kernel launchers
+  void launch_residual();
+  void launch_reset_image(const cl::Image2D& image);
+
+  SimpleVCycle inner_;
+
+  cl::Program program_;
+  cl::Kernel setup_system;
+  cl::Kernel calculate_residual;
+  cl::Kernel axpy;
+  cl::Kernel reset_image;
+  // The coefficient of axpy, (1, 1, 1, 1)
+  cl::Buffer one_;
+
+  cl::Image2D b_;
+  cl::Image2D x_;
+  cl::Image2D r_;
+  // axpy writes the updated x here, then it is swapped with x_
+  cl::Image2D tmp_;
+};
+
+}
+
+#endif  // REFINEMENT_H_
@@ -1,8 +1,32 @@
 #include "opencl.h"
 #include "solver.h"
 
+#include <algorithm>
+#include <cmath>
+
 namespace pv {
 
+namespace {
+
+bool inside_mask(const cv::Mat& rgba, int x, int y) {
+  return x >= 0 && y >= 0 && x < rgba.cols && y < rgba.rows &&
+         rgba.at<cv::Vec4b>(y, x)[3];
+}
+
+// Reads like the sampler of the kernels, repeating the border
+const cv::Vec4b& clamped_pixel(const cv::Mat& rgba, int x, int y) {
+  return rgba.at<cv::Vec4b>(std::min(std::max(y, 0), rgba.rows - 1),
+                            std::min(std::max(x, 0), rgba.cols - 1));
+}
+
+double determinant(const double m[3][3]) {
+  return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+         m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+         m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+}
+
+}
+
 Solver::Solver() :
     context_(),
     queue_(),
@@ -14,7 +38,11 @@ Solver::Solver() :
     region_source_(),
     region_target_(),
     pos_x_(),
-    pos_y_() {
+    pos_y_(),
+    domain_x_(),
+    domain_y_(),
+    boundary_(),
+    rim_() {
   origin_.push_back(0);
   origin_.push_back(0);
   origin_.push_back(0);
@@ -30,6 +58,34 @@ void Solver::set_source(cv::Mat source, cv::Mat mask) {
   source_ = pv::make_rgba(source, mask);
   cv::flip(source_, source_, 0);
 
+  cv::Rect domain = pv::mask_bounding_box(source_, 1);
+  domain_x_ = domain.x;
+  domain_y_ = domain.y;
+  source_ = source_(domain).clone();
+
+  // Neighbours beyond the domain read like the pixel itself, as with the
+  // sampler of the kernels
+  boundary_.clear();
+  rim_.clear();
+  for (int y = 0; y < source_.rows; ++y) {
+    for (int x = 0; x < source_.cols; ++x) {
+      bool inside = inside_mask(source_, x, y);
+      int neighbours[4][2] = { { x, y + 1 }, { x - 1, y }, { x, y - 1 },
+                               { x + 1, y } };
+      for (int i = 0; i < 4; ++i) {
+        int n_x = neighbours[i][0];
+        int n_y = neighbours[i][1];
+        if (n_x < 0 || n_y < 0 || n_x >= source_.cols || n_y >= source_.rows) {
+          continue;
+        }
+        if (inside != inside_mask(source_, n_x, n_y)) {
+          (inside ? rim_ : boundary_).push_back(cv::Point(x, y));
+          break;
+        }
+      }
+    }
+  }
+
   cl_source_ = cl::Image2D(context_, CL_MEM_READ_ONLY,
                               cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT8),
                               size_t(source_.cols), size_t(source_.rows));
@@ -45,9 +101,13 @@ void Solver::set_target(cv::Mat target) {
   target_ = pv::make_rgba(target);
   cv::flip(target_, target_, 0);
 
-  cl_target_ = cl::Image2D(context_, CL_MEM_READ_ONLY,
-                           cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT8),
-                           size_t(target.cols), size_t(target.rows));
+  // Frames of a video all have the same size and reuse the image
+  if (region_target_[0] != size_t(target_.cols) ||
+      region_target_[1] != size_t(target_.rows)) {
+    cl_target_ = cl::Image2D(context_, CL_MEM_READ_ONLY,
+                             cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT8),
+                             size_t(target.cols), size_t(target.rows));
+  }
 
   region_target_[0] = size_t(target_.cols);
   region_target_[1] = size_t(target_.rows);
@@ -56,10 +116,41 @@ void Solver::set_target(cv::Mat target) {
                            target_.data);
 }
 
+void Solver::share_source(const Solver& other) {
+  source_ = other.source_;
+  cl_source_ = other.cl_source_;
+  region_source_ = other.region_source_;
+  domain_x_ = other.domain_x_;
+  domain_y_ = other.domain_y_;
+  boundary_ = other.boundary_;
+  rim_ = other.rim_;
+}
+
+cl::Buffer Solver::create_rim_buffer() const {
+  if (rim_.empty()) {
+    return cl::Buffer();
+  }
+  std::vector<cl_int2> rim(rim_.size());
+  for (size_t i = 0; i < rim_.size(); ++i) {
+    rim[i].s[0] = rim_[i].x;
+    rim[i].s[1] = rim_[i].y;
+  }
+  return cl::Buffer(context_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                    rim.size() * sizeof(cl_int2), rim.data());
+}
+
+void Solver::share_target(const Solver& other) {
+  target_ = other.target_;
+  cl_target_ = other.cl_target_;
+  region_target_ = other.region_target_;
+}
+
 void Solver::init(cl::Context context,
                   cl::CommandQueue queue) {
   context_ = context;
   queue_ = queue;
+  // The target image of another context cannot be reused
+  region_target_[0] = 0;
 }
 
 void Solver::set_offset(int off_x, int off_y) {
@@ -67,9 +158,98 @@ void Solver::set_offset(int off_x, int off_y) {
   pos_y_ = off_y;
 }
 
+int Solver::solve_until(float tolerance, int max_cycles) {
+  int cycles = 0;
+  while (cycles < max_cycles) {
+    start_calculation_async(1);
+    ++cycles;
+    if (get_residual_average() <= tolerance) {
+      break;
+    }
+  }
+  return cycles;
+}
+
 void Solver::get_offset(int& off_x, int& off_y) {
   off_x = pos_x_;
   off_y = pos_y_;
 }
 
+void Solver::get_domain(int& x, int& y, int& width, int& height) {
+  x = domain_x_;
+  y = domain_y_;
+  width = source_.cols;
+  height = source_.rows;
+}
+
+bool Solver::fit_boundary_change(int old_x, int old_y,
+                                 cl_float4& a, cl_float4& b,
+                                 cl_float4& c) const {
+  if (boundary_.empty() || target_.empty()) {
+    return false;
+  }
+  // Normal equations, with the coordinates relative to the domain centre
+  double centre_x = 0.5 * source_.cols;
+  double centre_y = 0.5 * source_.rows;
+  double normal[3][3] = {};
+  double rhs[3][3] = {};  // [basis function][channel]
+  bool changed = false;
+  for (size_t i = 0; i < boundary_.size(); ++i) {
+    const cv::Point& p = boundary_[i];
+    const cv::Vec4b& now = clamped_pixel(target_, p.x + pos_x_ + domain_x_,
+                                         p.y + pos_y_ + domain_y_);
+    const cv::Vec4b& before = clamped_pixel(target_, p.x + old_x + domain_x_,
+                                            p.y + old_y + domain_y_);
+    double basis[3] = { 1.0, p.x - centre_x, p.y - centre_y };
+    for (int k = 0; k < 3; ++k) {
+      for (int l = 0; l < 3; ++l) {
+        normal[k][l] += basis[k] * basis[l];
+      }
+      for (int channel = 0; channel < 3; ++channel) {
+        double change = double(now[channel]) - double(before[channel]);
+        changed = changed || change != 0.0;
+        rhs[k][channel] += basis[k] * change;
+      }
+    }
+  }
+  if (!changed) {
+    return false;
+  }
+
+  double coefficients[3][3];  // [basis function][channel]
+  double det = determinant(normal);
+  if (std::fabs(det) <= 1e-9 * normal[0][0] * normal[1][1] * normal[2][2]) {
+    // A boundary along a line does not determine the slope across it, so
+    // only the mean change is used
+    for (int channel = 0; channel < 3; ++channel) {
+      coefficients[0][channel] = rhs[0][channel] / normal[0][0];
+      coefficients[1][channel] = 0.0;
+      coefficients[2][channel] = 0.0;
+    }
+  } else {
+    // Cramer's rule
+    for (int k = 0; k < 3; ++k) {
+      for (int channel = 0; channel < 3; ++channel) {
+        double replaced[3][3];
+        for (int row = 0; row < 3; ++row) {
+          for (int column = 0; column < 3; ++column) {
+            replaced[row][column] = column == k ? rhs[row][channel]
+                                                : normal[row][column];
+          }
+        }
+        coefficients[k][channel] = determinant(replaced) / det;
+      }
+    }
+  }
+  for (int channel = 0; channel < 3; ++channel) {
+    a.s[channel] = float(coefficients[0][channel] -
+                         coefficients[1][channel] * centre_x -
+                         coefficients[2][channel] * centre_y);
+    b.s[channel] = float(coefficients[1][channel]);
+    c.s[channel] = float(coefficients[2][channel]);
+  }
+  a.s[3] = b.s[3] = c.s[3] = 0.0f;
+  return true;
+}
+
 }
@@ -6,6 +6,8 @@
 
 #include <cv.h>
 
+#include <vector>
+
 namespace pv {
 
 class Solver {
@@ -15,20 +17,52 @@ class Solver {
 
   virtual void set_source(cv::Mat source, cv::Mat mask);
   virtual void set_target(cv::Mat target);
+  // Replaces the target by the next frame of a video and starts from the
+  // current solution instead of the source pixels, only the right hand side
+  // is rebuilt. Neighbouring frames differ little, so a cycle or two per
+  // frame usually suffices. The default starts over like set_target().
+  virtual void next_frame(cv::Mat target) { set_target(target); }
 
   virtual void init(cl::Context context,
                     cl::CommandQueue queue);
 
   virtual void set_offset(int off_x, int off_y);
   void get_offset(int& off_x, int& off_y);
+  // Part of the (vertically flipped) source the system is solved on: the
+  // bounding box of the mask plus the one pixel ring the boundary conditions
+  // read. The solution images cover just this region, offset by (x, y).
+  virtual void get_domain(int& x, int& y, int& width, int& height);
 
   virtual void start_calculation_async(double number_iterations) = 0;
   virtual float get_residual_average() = 0;
+  // Requests the residual average of the current state and returns the
+  // latest one that has already arrived, usually the previous call's. The
+  // default falls back to the blocking get_residual_average().
+  virtual float get_residual_average_async() {
+    return get_residual_average();
+  }
+  // Runs cycles until the residual average drops to tolerance or max_cycles
+  // have been run, returns the number of cycles.
+  virtual int solve_until(float tolerance, int max_cycles);
 
   virtual const cl::Image2D& current_solution() = 0;
   virtual const cl::Image2D& current_residual() = 0;
 
  protected:
+  // Take over the source or the target of other instead of uploading them
+  // again, for solvers that wrap another one
+  void share_source(const Solver& other);
+  void share_target(const Solver& other);
+
+  // Least squares fit of a plane a + b * x + c * y, in domain coordinates, to
+  // how the target values that the boundary conditions read change from
+  // offset (old_x, old_y) to the current one. Returns false if they did not
+  // change.
+  bool fit_boundary_change(int old_x, int old_y,
+                           cl_float4& a, cl_float4& b, cl_float4& c) const;
+  // rim_ as a buffer of cl_int2 for the kernels, empty without a rim
+  cl::Buffer create_rim_buffer() const;
+
   cl::Context context_;
   cl::CommandQueue queue_;
 
@@ -44,6 +78,15 @@ class Solver {
 
   int pos_x_;
   int pos_y_;
+  int domain_x_;
+  int domain_y_;
+
+  // Pixels of the domain outside the mask next to a pixel inside it, where
+  // the boundary conditions read the target
+  std::vector<cv::Point> boundary_;
+  // Pixels inside the mask next to one of boundary_, the only equations
+  // that depend on the target and the offset
+  std::vector<cv::Point> rim_;
 };
 
 }
@@ -0,0 +1,124 @@
+// Pastes several parts of lena with BatchPaste and one by one with
+// SimpleVCycle, twice with different parts, fails unless the pasted targets
+// agree
+
+#include "opencl.h"
+#include "batch.h"
+#include "context.h"
+#include "test_paste.h"
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+// In grey levels, after rounding to 8 bits
+const int MAX_DIFFERENCE = 2;
+
+int max_difference_8u(const cv::Mat& a, const cv::Mat& b) {
+  int difference = 0;
+  for (int y = 0; y < a.rows; ++y) {
+    for (int x = 0; x < a.cols; ++x) {
+      for (int c = 0; c < 3; ++c) {
+        difference = std::max(difference,
+                              std::abs(a.at<cv::Vec3b>(y, x)[c] -
+                                       b.at<cv::Vec3b>(y, x)[c]));
+      }
+    }
+  }
+  return difference;
+}
+
+// Pastes the count parts of lena into target, at positions, once as a batch
+// and once one by one, returns the largest difference of the pasted targets
+int paste_batch(const cl::Context& context, const cl::CommandQueue& queue,
+                pv::BatchPaste& batch, const cv::Mat& lena,
+                const cv::Mat& target, const cv::Rect* parts,
+                const cv::Point* positions, size_t count,
+                const std::string& name) {
+  batch.clear();
+  std::vector<pv::Paste> pastes(count);
+  std::vector<cv::Mat> batch_targets;
+  for (size_t i = 0; i < count; ++i) {
+    pv::Paste& paste = pastes[i];
+    paste.tolerance = 0.001f;
+    paste.source = lena(parts[i]).clone();
+    paste.mask = cv::Mat::zeros(paste.source.size(), CV_8U);
+    cv::ellipse(paste.mask,
+                cv::Point(paste.source.cols / 2, paste.source.rows / 2),
+                cv::Size(paste.source.cols / 2 - 10,
+                         paste.source.rows / 2 - 10),
+                0, 0, 360, cv::Scalar(255), -1);
+    paste.target = target.clone();
+    paste.x = positions[i].x;
+    paste.y = positions[i].y;
+    std::ostringstream output;
+    output << name << "_single_" << i << ".png";
+    paste.output = output.str();
+    batch_targets.push_back(target.clone());
+    batch.add_job(paste.source, paste.mask, batch_targets.back(),
+                  paste.x, paste.y);
+
+    // The single paste, written by Paste::write like pv-paste does
+    pv::SimpleVCycle solver;
+    solver.init(context, queue);
+    pv::solve(solver, paste);
+    int domain_x, domain_y, width, height;
+    solver.get_domain(domain_x, domain_y, width, height);
+    paste.write(pv::read_cl_image(queue, solver.current_solution()),
+                domain_x, domain_y);
+  }
+  int cycles = batch.solve(pastes[0].tolerance, pastes[0].max_cycles);
+
+  int difference = 0;
+  for (size_t i = 0; i < count; ++i) {
+    batch.paste(i);
+    difference = std::max(difference, max_difference_8u(batch_targets[i],
+                                                        pastes[i].target));
+  }
+  std::cout << name << " solved in " << cycles << " cycles, difference "
+            << difference << std::endl;
+  return difference;
+}
+
+}
+
+int main() {
+  cl::Context context;
+  cl::CommandQueue queue;
+  pv::init_cl(context, queue);
+
+  cv::Mat lena = load_lena();
+  cv::Mat target;
+  cv::flip(lena, target, 1);
+
+  // Parts of lena and where they go in the mirrored lena
+  const size_t JOBS = 3;
+  cv::Rect parts[JOBS] = { cv::Rect(200, 200, 200, 200),
+                           cv::Rect(20, 300, 120, 80),
+                           cv::Rect(350, 40, 60, 150) };
+  cv::Point positions[JOBS] = { cv::Point(150, 120), cv::Point(300, 380),
+                                cv::Point(40, 60) };
+  // A second batch on the same BatchPaste, with an atlas of another size,
+  // must not see the grids of the first one
+  const size_t SECOND_JOBS = 2;
+  cv::Rect second_parts[SECOND_JOBS] = { cv::Rect(100, 250, 90, 60),
+                                         cv::Rect(300, 300, 140, 120) };
+  cv::Point second_positions[SECOND_JOBS] = { cv::Point(60, 200),
+                                              cv::Point(320, 80) };
+
+  pv::BatchPaste batch;
+  batch.init(context, queue);
+  int difference = paste_batch(context, queue, batch, lena, target, parts,
+                               positions, JOBS, "batch");
+  difference = std::max(difference,
+                        paste_batch(context, queue, batch, lena, target,
+                                    second_parts, second_positions,
+                                    SECOND_JOBS, "second_batch"));
+  if (difference > MAX_DIFFERENCE) {
+    std::cerr << "ERROR: BatchPaste differs from single pastes" << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
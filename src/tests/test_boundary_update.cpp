@@ -0,0 +1,92 @@
+// Moves a paste with SimpleVCycle::set_offset, which only rebuilds the
+// boundary equations of b, and fails unless b matches the right hand side
+// that setup_system builds from scratch at the new offset
+
+#include "opencl.h"
+#include "context.h"
+#include "test_paste.h"
+
+namespace {
+
+// Right hand side of setup_system for the domain of source, as
+// SimpleVCycle::current_rhs() holds it
+cv::Mat setup_rhs(cl::Context& context, cl::CommandQueue& queue,
+                  const pv::Paste& paste) {
+  cv::Mat source_rgba = pv::make_rgba(paste.source, paste.mask);
+  cv::flip(source_rgba, source_rgba, 0);
+  cv::Rect domain = pv::mask_bounding_box(source_rgba, 1);
+  source_rgba = source_rgba(domain).clone();
+  cv::Mat target_rgba = pv::make_rgba(paste.target);
+  cv::flip(target_rgba, target_rgba, 0);
+
+  cl::Image2D cl_source(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                        cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT8),
+                        size_t(source_rgba.cols), size_t(source_rgba.rows),
+                        0, source_rgba.data);
+  cl::Image2D cl_target(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                        cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT8),
+                        size_t(target_rgba.cols), size_t(target_rgba.rows),
+                        0, target_rgba.data);
+  // setup_system only writes the pixels inside the mask
+  cv::Mat zero = cv::Mat::zeros(source_rgba.size(), CV_32FC4);
+  cl::Image2D b(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                cl::ImageFormat(CL_RGBA, CL_FLOAT),
+                size_t(zero.cols), size_t(zero.rows), 0, zero.data);
+  cl::Image2D x(context, CL_MEM_READ_WRITE,
+                cl::ImageFormat(CL_RGBA, CL_FLOAT),
+                size_t(zero.cols), size_t(zero.rows));
+
+  cl::Program program = pv::load_program(context, "hellocl_kernels");
+  cl::Kernel setup_system(program, "setup_system", NULL);
+  setup_system.setArg<cl::Image2D>(0, cl_source);
+  setup_system.setArg<cl::Image2D>(1, cl_target);
+  setup_system.setArg<cl::Image2D>(2, b);
+  setup_system.setArg<cl::Image2D>(3, x);
+  setup_system.setArg<cl_int>(4, paste.off_x() + domain.x);
+  setup_system.setArg<cl_int>(5, paste.off_y() + domain.y);
+  setup_system.setArg<cl_int>(6, 1);
+  queue.enqueueNDRangeKernel(
+    setup_system,
+    cl::NullRange,
+    cl::NDRange(size_t(source_rgba.cols), size_t(source_rgba.rows)),
+    cl::NullRange
+  );
+  return pv::read_cl_image(queue, b);
+}
+
+}
+
+int main() {
+  cl::Context context;
+  cl::CommandQueue queue;
+  pv::init_cl(context, queue);
+
+  pv::Paste paste = lena_paste();
+
+  pv::SimpleVCycle solver;
+  solver.init(context, queue);
+  solver.set_source(paste.source, paste.mask);
+  solver.set_target(paste.target);
+  solver.set_offset(paste.off_x(), paste.off_y());
+  solver.start_calculation_async(2);
+
+  const int MOVES = 3;
+  cv::Point moves[MOVES] = { cv::Point(0, 0), cv::Point(17, 9),
+                             cv::Point(-57, -32) };
+  float difference = 0.0f;
+  for (int i = 0; i < MOVES; ++i) {
+    paste.x += moves[i].x;
+    paste.y += moves[i].y;
+    solver.set_offset(paste.off_x(), paste.off_y());
+    solver.start_calculation_async(1);
+    cv::Mat expected = setup_rhs(context, queue, paste);
+    cv::Mat actual = pv::read_cl_image(queue, solver.current_rhs());
+    difference = std::max(difference, max_difference(expected, actual));
+  }
+  std::cout << "largest difference " << difference << std::endl;
+  if (difference > 0.001f) {
+    std::cerr << "ERROR: set_offset differs from setup_system" << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,60 @@
+// Moves a solved paste a few times and runs a few frames after each move,
+// fails unless the moved solution is closer to the new one than a solve
+// that starts over at the new offset
+
+#include "opencl.h"
+#include "context.h"
+#include "test_paste.h"
+
+namespace {
+
+// Frames of one cycle each after a move, as the frontend runs them while
+// the paste is dragged
+const int FRAMES = 3;
+
+float residual_after_frames(pv::SimpleVCycle& solver) {
+  for (int i = 0; i < FRAMES; ++i) {
+    solver.start_calculation_async(1);
+  }
+  return solver.get_residual_average();
+}
+
+}
+
+int main() {
+  cl::Context context;
+  cl::CommandQueue queue;
+  pv::init_cl(context, queue);
+  pv::Paste paste = lena_paste();
+
+  pv::SimpleVCycle moved;
+  moved.init(context, queue);
+  pv::solve(moved, paste);
+
+  const int MOVES = 3;
+  cv::Point moves[MOVES] = { cv::Point(8, 0), cv::Point(0, -6),
+                             cv::Point(5, 5) };
+  bool ok = true;
+  for (int i = 0; i < MOVES; ++i) {
+    paste.x += moves[i].x;
+    paste.y += moves[i].y;
+    moved.set_offset(paste.off_x(), paste.off_y());
+    float warm = residual_after_frames(moved);
+
+    pv::SimpleVCycle fresh;
+    fresh.init(context, queue);
+    fresh.set_source(paste.source, paste.mask);
+    fresh.set_target(paste.target);
+    fresh.set_offset(paste.off_x(), paste.off_y());
+    float cold = residual_after_frames(fresh);
+
+    std::cout << "move " << i << ": residual " << warm << " after " << FRAMES
+              << " frames, " << cold << " when starting over" << std::endl;
+    if (warm >= cold) {
+      std::cerr << "ERROR: move " << i << " does not resume closer to the"
+                << " solution than starting over" << std::endl;
+      ok = false;
+    }
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,58 @@
+// Solves lena_paste() with MultiDeviceVCycle on two queues of the same
+// device, fails unless it reaches the tolerance of the paste and agrees
+// with PlanarVCycle inside the mask
+
+#include "opencl.h"
+#include "multi_device.h"
+#include "planar.h"
+#include "test_paste.h"
+
+#include <vector>
+
+namespace {
+
+// In grey levels. The strips only see the rows of their neighbour after a
+// smoothing pass, so both solutions meet the tolerance of the paste with
+// differently damped smooth error components.
+const float MAX_DIFFERENCE = 2.0f;
+
+}
+
+int main() {
+  cl::Context context;
+  cl::CommandQueue queue;
+  pv::init_cl(context, queue);
+  pv::Paste paste = lena_paste();
+
+  pv::PlanarVCycle planar;
+  planar.init(context, queue);
+  pv::solve(planar, paste);
+  cv::Mat reference = pv::read_cl_image(queue, planar.current_solution());
+
+  // A second queue on the same device still cuts the domain into two
+  // strips with a boundary exchange between them
+  std::vector<cl::CommandQueue> queues(1, queue);
+  queues.push_back(cl::CommandQueue(context,
+                                    queue.getInfo<CL_QUEUE_DEVICE>()));
+  pv::MultiDeviceVCycle multi_device;
+  multi_device.init(context, queues);
+  int cycles = pv::solve(multi_device, paste);
+  float residual = multi_device.get_residual_average();
+  float difference = max_difference(
+      reference, pv::read_cl_image(queue, multi_device.current_solution()));
+  std::cout << "MultiDeviceVCycle: residual " << residual << " after "
+            << cycles << " cycles, difference " << difference << std::endl;
+
+  bool ok = true;
+  if (residual > paste.tolerance) {
+    std::cerr << "ERROR: MultiDeviceVCycle residual above " << paste.tolerance
+              << std::endl;
+    ok = false;
+  }
+  if (difference > MAX_DIFFERENCE) {
+    std::cerr << "ERROR: MultiDeviceVCycle differs from PlanarVCycle by "
+              << difference << std::endl;
+    ok = false;
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
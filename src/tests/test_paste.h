@@ -0,0 +1,60 @@
+#ifndef TEST_PASTE_H_
+#define TEST_PASTE_H_
+
+#include <cv.h>
+#include <highgui.h>
+
+#include "cli/paste.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+// Needs lena.png in the working directory
+inline cv::Mat load_lena() {
+  cv::Mat lena = cv::imread("lena.png");
+  if (lena.empty()) {
+    std::cerr << "ERROR: cannot read lena.png" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return lena;
+}
+
+// The face of lena with an elliptic mask, pasted into lena mirrored
+// horizontally, to be solved to a mean squared residual of 0.001
+inline pv::Paste lena_paste() {
+  cv::Mat lena = load_lena();
+  pv::Paste paste;
+  paste.tolerance = 0.001f;
+  paste.max_cycles = 50;
+  paste.source = lena(cv::Rect(200, 200, 200, 200)).clone();
+  paste.mask = cv::Mat::zeros(paste.source.size(), CV_8U);
+  cv::ellipse(paste.mask, cv::Point(100, 100), cv::Size(70, 90), 0, 0, 360,
+              cv::Scalar(255), -1);
+  cv::flip(lena, paste.target, 1);
+  paste.x = 150;
+  paste.y = 192;
+  return paste;
+}
+
+// Largest difference of the RGB channels of two CV_32FC4 images of the
+// same domain over the pixels inside the mask, where the w of a is nonzero
+inline float max_difference(const cv::Mat& a, const cv::Mat& b) {
+  float difference = 0.0f;
+  for (int y = 0; y < a.rows; ++y) {
+    for (int x = 0; x < a.cols; ++x) {
+      const cv::Vec4f& a_val = a.at<cv::Vec4f>(y, x);
+      const cv::Vec4f& b_val = b.at<cv::Vec4f>(y, x);
+      if (a_val[3] == 0.0f) {
+        continue;
+      }
+      for (int c = 0; c < 3; ++c) {
+        difference = std::max(difference, std::fabs(a_val[c] - b_val[c]));
+      }
+    }
+  }
+  return difference;
+}
+
+#endif  // TEST_PASTE_H_
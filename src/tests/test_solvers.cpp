@@ -0,0 +1,82 @@
+// Solves lena_paste() with every solver, fails unless each one reaches
+// the tolerance of the paste and agrees with SimpleVCycle inside the mask
+
+#include "opencl.h"
+#include "native.h"
+#include "pcg.h"
+#include "planar.h"
+#include "refinement.h"
+#include "test_paste.h"
+
+#include <string>
+
+namespace {
+
+// In grey levels. Two solutions that both meet the tolerance of the
+// paste still differ in their smoothest error components, which the
+// residual hardly sees.
+const float MAX_DIFFERENCE = 2.0f;
+
+bool check(const std::string& name, const pv::Paste& paste, int cycles,
+           float residual, const cv::Mat& solution,
+           const cv::Mat& reference) {
+  float difference = max_difference(reference, solution);
+  std::cout << name << ": residual " << residual << " after " << cycles
+            << " cycles, difference " << difference << std::endl;
+  if (residual > paste.tolerance) {
+    std::cerr << "ERROR: " << name << " residual above " << paste.tolerance
+              << std::endl;
+    return false;
+  }
+  if (difference > MAX_DIFFERENCE) {
+    std::cerr << "ERROR: " << name << " differs from SimpleVCycle by "
+              << difference << std::endl;
+    return false;
+  }
+  return true;
+}
+
+}
+
+int main() {
+  cl::Context context;
+  cl::CommandQueue queue;
+  pv::init_cl(context, queue);
+  pv::Paste paste = lena_paste();
+
+  pv::SimpleVCycle vcycle;
+  vcycle.init(context, queue);
+  int cycles = pv::solve(vcycle, paste);
+  cv::Mat reference = pv::read_cl_image(queue, vcycle.current_solution());
+  bool ok = check("SimpleVCycle", paste, cycles, vcycle.get_residual_average(),
+                  reference, reference);
+
+  pv::MultigridPCG pcg;
+  pcg.init(context, queue);
+  cycles = pv::solve(pcg, paste);
+  ok = check("MultigridPCG", paste, cycles, pcg.get_residual_average(),
+             pv::read_cl_image(queue, pcg.current_solution()),
+             reference) && ok;
+
+  pv::IterativeRefinement refinement;
+  refinement.init(context, queue);
+  cycles = pv::solve(refinement, paste);
+  ok = check("IterativeRefinement", paste, cycles,
+             refinement.get_residual_average(),
+             pv::read_cl_image(queue, refinement.current_solution()),
+             reference) && ok;
+
+  pv::PlanarVCycle planar;
+  planar.init(context, queue);
+  cycles = pv::solve(planar, paste);
+  ok = check("PlanarVCycle", paste, cycles, planar.get_residual_average(),
+             pv::read_cl_image(queue, planar.current_solution()),
+             reference) && ok;
+
+  pv::NativeVCycle native;
+  cycles = pv::solve(native, paste);
+  ok = check("NativeVCycle", paste, cycles, native.get_residual_average(),
+             native.current_solution(), reference) && ok;
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -5,7 +5,7 @@
 int main() {
   cl::Context context;
   cl::CommandQueue queue;
-  pv::init_cl(context, queue, false);
+  pv::init_cl(context, queue);
 
   cl::Program program = pv::load_program(context, "hellocl_kernels");
   cv::Mat lena_original = cv::imread("lena.png");
@@ -35,6 +35,7 @@ int main() {
                           lena.data);
   bilinear_restrict.setArg<cl::Image2D>(0, cl_lena);
   bilinear_restrict.setArg<cl::Image2D>(1, cl_lena_256);
+  bilinear_restrict.setArg<cl::Buffer>(2, cl::Buffer());
   queue.enqueueNDRangeKernel(
     bilinear_restrict,
     cl::NullRange,
@@ -0,0 +1,129 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+namespace pv {
+
+ThreadPool::ThreadPool(unsigned threads) :
+    queues_(),
+    threads_(),
+    mutex_(),
+    wake_(),
+    done_(),
+    task_(NULL),
+    generation_(0),
+    busy_(0),
+    quit_(false) {
+  if (threads == 0) {
+    threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  for (unsigned i = 0; i < threads; ++i) {
+    queues_.push_back(std::unique_ptr<Queue>(new Queue));
+  }
+  // Thread 0 is the one calling parallel_for
+  for (unsigned i = 1; i < threads; ++i) {
+    threads_.push_back(std::thread(&ThreadPool::work, this, i));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  wake_.notify_all();
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    threads_[i].join();
+  }
+}
+
+void ThreadPool::parallel_for(int count,
+                              const std::function<void(int)>& task) {
+  if (count <= 0) {
+    return;
+  }
+  unsigned n = size();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (unsigned i = 0; i < n; ++i) {
+      std::lock_guard<std::mutex> queue_lock(queues_[i]->mutex);
+      queues_[i]->begin = int(long(count) * i / n);
+      queues_[i]->end = int(long(count) * (i + 1) / n);
+    }
+    task_ = &task;
+    busy_ = n - 1;
+    ++generation_;
+  }
+  wake_.notify_all();
+  run(0);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (busy_ != 0) {
+    done_.wait(lock);
+  }
+  task_ = NULL;
+}
+
+void ThreadPool::work(unsigned index) {
+  unsigned seen = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (!quit_ && generation_ == seen) {
+        wake_.wait(lock);
+      }
+      if (quit_) {
+        return;
+      }
+      seen = generation_;
+    }
+    run(index);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--busy_ == 0) {
+      done_.notify_one();
+    }
+  }
+}
+
+void ThreadPool::run(unsigned index) {
+  int task;
+  while (next_task(index, task)) {
+    (*task_)(task);
+  }
+}
+
+bool ThreadPool::next_task(unsigned index, int& task) {
+  {
+    Queue& own = *queues_[index];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (own.begin < own.end) {
+      task = own.begin++;
+      return true;
+    }
+  }
+  unsigned n = size();
+  for (unsigned i = 1; i < n; ++i) {
+    Queue& victim = *queues_[(index + i) % n];
+    int begin, end;
+    {
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (victim.begin >= victim.end) {
+        continue;
+      }
+      begin = victim.begin + (victim.end - victim.begin) / 2;
+      end = victim.end;
+      victim.end = begin;
+    }
+    // Only one lock is held at a time, the stolen share is not visible to
+    // other thieves until it is stored in the own queue
+    Queue& own = *queues_[index];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    task = begin;
+    own.begin = begin + 1;
+    own.end = end;
+    return true;
+  }
+  return false;
+}
+
+}
@@ -0,0 +1,58 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace pv {
+
+// Fixed set of worker threads for data parallel loops. Every thread starts
+// on an equal share of the task indices and, once that runs dry, steals the
+// upper half of the remaining share of another thread, so uneven tasks (e.g.
+// tiles mostly outside the mask) still balance.
+class ThreadPool {
+ public:
+  // threads == 0 uses one thread per hardware thread. The calling thread
+  // counts as one of them.
+  explicit ThreadPool(unsigned threads = 0);
+  ~ThreadPool();
+
+  unsigned size() const { return unsigned(queues_.size()); }
+
+  // Calls task(i) for all i in [0, count), returns when all calls are done
+  void parallel_for(int count, const std::function<void(int)>& task);
+
+ private:
+  struct Queue {
+    Queue() : mutex(), begin(0), end(0) {}
+    std::mutex mutex;
+    int begin;
+    int end;
+  };
+
+  ThreadPool(const ThreadPool&);
+  ThreadPool& operator=(const ThreadPool&);
+
+  void work(unsigned index);
+  void run(unsigned index);
+  bool next_task(unsigned index, int& task);
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> threads_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  const std::function<void(int)>* task_;
+  unsigned generation_;
+  unsigned busy_;
+  bool quit_;
+};
+
+}
+
+#endif  // THREAD_POOL_H_